@@ -2,12 +2,95 @@
  * Created by Ivo Georgiev on 2/9/16.
  */
 
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS under -std=c11
+
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <stdio.h> // for perror()
+#include <errno.h>
+#include <stdatomic.h> // for the stats seqlock
+#include <sched.h> // for sched_yield()
+#include <time.h> // for clock_gettime()
+#include <pthread.h> // for the reporter thread and the pool store lock
+#include <unistd.h> // for sysconf()
+#include <sys/mman.h> // for mmap(), mprotect(), madvise()
+#include <fcntl.h> // for open()
+#include <sys/socket.h> // for the reporter's Unix domain socket
+#include <sys/un.h>
+#include <sys/time.h> // for the reporter's send timeout
 
 #include "mem_pool.h"
 
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0 // not available on all platforms
+#endif
+
+#ifdef MEM_POOL_COUNTERS
+#define MEM_COUNT(pool_mgr, counter, n) ((pool_mgr)->counters.counter += (n))
+#else
+#define MEM_COUNT(pool_mgr, counter, n) ((void) 0) // compiled out
+#endif
+
+#ifdef MEM_POOL_LATENCY
+#define MEM_LATENCY_START(start) unsigned long start = _mem_now_ns()
+#define MEM_LATENCY_RECORD(pool_mgr, op, start) _mem_record_latency(pool_mgr, op, _mem_now_ns() - (start))
+#else
+#define MEM_LATENCY_START(start) ((void) 0) // compiled out
+#define MEM_LATENCY_RECORD(pool_mgr, op, start) ((void) 0)
+#endif
+
+// static probes for perf/bpftrace (provider mem_pool), no-ops unless built
+// with MEM_POOL_PROBES; even then, a probe is a single nop until attached to
+//   open(pool, total_size, policy)     close(pool)
+//   alloc(pool, size, mem)             free(pool, mem, status)
+//   search(pool, size, mem, length)    (mem is NULL on a miss)
+//   split(pool, mem, size, remaining)  coalesce(pool, mem, size)
+//   node_heap_grow(pool, total_nodes)  gap_ix_grow(pool, capacity)
+#ifdef MEM_POOL_PROBES
+#include <sys/sdt.h>
+#define MEM_PROBE1(name, a) DTRACE_PROBE1(mem_pool, name, a)
+#define MEM_PROBE2(name, a, b) DTRACE_PROBE2(mem_pool, name, a, b)
+#define MEM_PROBE3(name, a, b, c) DTRACE_PROBE3(mem_pool, name, a, b, c)
+#define MEM_PROBE4(name, a, b, c, d) DTRACE_PROBE4(mem_pool, name, a, b, c, d)
+#else
+#define MEM_PROBE1(name, a) ((void) 0) // compiled out
+#define MEM_PROBE2(name, a, b) ((void) 0)
+#define MEM_PROBE3(name, a, b, c) ((void) 0)
+#define MEM_PROBE4(name, a, b, c, d) ((void) 0)
+#endif
+
+// sampled allocations keep this many frames of their call stack
+#ifdef MEM_POOL_PROFILE
+#include <execinfo.h> // for backtrace()
+#define MEM_PROFILE_ALLOC(pool_mgr, mem, size) _mem_profile_alloc(pool_mgr, mem, size)
+#define MEM_PROFILE_FREE(mem) _mem_profile_free(mem)
+#define MEM_PROFILE_DROP(pool_mgr, from) _mem_profile_drop(pool_mgr, from)
+#else
+#define MEM_PROFILE_ALLOC(pool_mgr, mem, size) ((void) 0) // compiled out
+#define MEM_PROFILE_FREE(mem) ((void) 0)
+#define MEM_PROFILE_DROP(pool_mgr, from) ((void) 0)
+#endif
+#define MEM_PROFILE_DEPTH 32
+
+// renders a frame of the pool's layout every so many operations
+#ifdef MEM_POOL_LAYOUT
+#define MEM_LAYOUT_TICK(pool_mgr) ((pool_mgr)->layout_every ? _mem_layout_tick(pool_mgr) : (void) 0)
+#else
+#define MEM_LAYOUT_TICK(pool_mgr) ((void) 0) // compiled out
+#endif
+#define MEM_LAYOUT_CLASSES 8
+
+// an arena tells this many nested rewind points apart exactly, see _mem_arena_lower
+#define MEM_ARENA_FLOORS 8
+
+// latency buckets: exact below 2^MEM_LATENCY_SUB_BITS ns, then that many
+// per power of two, up to 2^MEM_LATENCY_MAX_BITS ns (about 18 minutes)
+#define MEM_LATENCY_SUB_BITS 3
+#define MEM_LATENCY_MAX_BITS 40
+#define MEM_LATENCY_BUCKETS ((MEM_LATENCY_MAX_BITS - MEM_LATENCY_SUB_BITS + 1) << MEM_LATENCY_SUB_BITS)
+
 /*************/
 /*           */
 /* Constants */
@@ -23,10 +106,52 @@ static const unsigned   MEM_POOL_STORE_EXPAND_FACTOR    = 2;
 static const unsigned   MEM_NODE_HEAP_INIT_CAPACITY     = 40;
 static const float      MEM_NODE_HEAP_FILL_FACTOR       = 0.75;
 static const unsigned   MEM_NODE_HEAP_EXPAND_FACTOR     = 2;
+static const float      MEM_NODE_HEAP_SHRINK_FACTOR     = 0.25;
 
 static const unsigned   MEM_GAP_IX_INIT_CAPACITY        = 40;
 static const float      MEM_GAP_IX_FILL_FACTOR          = 0.75;
 static const unsigned   MEM_GAP_IX_EXPAND_FACTOR        = 2;
+static const float      MEM_GAP_IX_SHRINK_FACTOR        = 0.25;
+static const unsigned   MEM_GAP_IX_LAZY_FREES           = 4; // in a row, then rebuild later
+
+static const unsigned   MEM_ALLOC_IX_INIT_CAPACITY      = 64; // power of two
+static const float      MEM_ALLOC_IX_FILL_FACTOR        = 0.5;
+static const unsigned   MEM_ALLOC_IX_EXPAND_FACTOR      = 2;
+
+static const unsigned   MEM_EXTENTS_INIT_CAPACITY       = 4;
+
+static const unsigned   MEM_QUICK_LISTS                 = 64; // power of two
+static const unsigned   MEM_QUICK_LIST_INIT_CAP         = 4;
+static const unsigned   MEM_QUICK_LIST_EXPAND_FACTOR    = 2;
+
+static const size_t     MEM_CACHE_LINE_SIZE             = 64;
+
+static const size_t     MEM_TAG_HEADER_SIZE             = 2 * sizeof(size_t); // tag, requested size
+static const size_t     MEM_TAG_FOOTER_SIZE             = sizeof(size_t); // tag
+static const size_t     MEM_TAG_ALIGN                   = 16; // power of two
+static const size_t     MEM_TAG_MIN_BLOCK               = 32;
+
+static const size_t     MEM_BITMAP_DEFAULT_GRANULE      = 64; // power of two
+static const size_t     MEM_BITMAP_WORD_BITS            = 64;
+
+static const size_t     MEM_REPORT_MAX_PATH             = 108; // sizeof(sockaddr_un.sun_path) on Linux
+static const unsigned   MEM_REPORT_SEND_TIMEOUT_MS      = 1000; // a socket that stalls longer is dropped
+
+static const size_t     MEM_LAYOUT_MAX_CELLS            = 1 << 24;
+// allocation size classes: below 32 bytes, then every factor of 4 up to 128KiB and above
+static const char *     MEM_LAYOUT_LABELS[MEM_LAYOUT_CLASSES] = { "<32", "<128", "<512", "<2K",
+                                                                  "<8K", "<32K", "<128K", "more" };
+static const unsigned   MEM_LAYOUT_ANSI[MEM_LAYOUT_CLASSES] = { 34, 36, 32, 33, 35, 31, 91, 97 }; // SGR colors
+static const unsigned char MEM_LAYOUT_RGB[MEM_LAYOUT_CLASSES][3] = {
+    { 59, 110, 232 }, { 40, 190, 200 }, { 70, 190, 70 }, { 230, 200, 40 },
+    { 200, 80, 200 }, { 220, 60, 50 }, { 255, 140, 120 }, { 240, 240, 240 } };
+
+#ifdef MEM_POOL_PROFILE
+static const size_t     MEM_PROFILE_DEFAULT_RATE        = 512 * 1024; // bytes per sample, on average
+static const unsigned   MEM_PROFILE_IX_INIT_CAPACITY    = 256; // power of two
+static const float      MEM_PROFILE_IX_FILL_FACTOR      = 0.5;
+static const unsigned   MEM_PROFILE_IX_EXPAND_FACTOR    = 2;
+#endif
 
 
 
@@ -44,6 +169,10 @@ typedef struct _node {
     alloc_t alloc_record;
     unsigned used;
     unsigned allocated;
+    unsigned boundary; // 1-first node of a backing extent, never merged into prev
+    unsigned purged; // 1-whole pages inside the gap were returned to the OS
+    unsigned deferred; // 1-freed, but neither coalesced nor in the gap index yet
+    unsigned quick_next; // quick list link: node index + 1, 0 ends the list
     struct _node *next, *prev; // doubly-linked list for gap deletion
 } node_t, *node_pt;
 
@@ -52,13 +181,125 @@ typedef struct _gap {
     node_pt node;
 } gap_t, *gap_pt;
 
+typedef struct _alloc_ix_entry {
+    unsigned node; // index in the node heap
+    unsigned epoch; // the entry is empty, unless equal to alloc_ix_epoch
+} alloc_ix_entry_t, *alloc_ix_entry_pt;
+
+typedef struct _quick_list {
+    size_t size; // the exact size of the nodes on the list
+    unsigned head; // node index + 1, 0 for none
+    unsigned count;
+    unsigned cap; // 0-unused slot
+    unsigned hits; // since the last flush
+} quick_list_t, *quick_list_pt;
+
+typedef struct _extent {
+    char *mem;
+    size_t size;
+} extent_t, *extent_pt;
+
+typedef struct _arena_floor {
+    unsigned long epoch; // started when the bump pointer went down to top
+    size_t top;
+} arena_floor_t;
+
+typedef struct _latency_hist {
+    unsigned long count;
+    unsigned long max;
+    unsigned long buckets[MEM_LATENCY_BUCKETS];
+} latency_hist_t, *latency_hist_pt;
+
+// the process's histograms take samples from every thread, see _mem_record_latency
+typedef struct _shared_latency_hist {
+    atomic_ulong count;
+    atomic_ulong max;
+    atomic_ulong buckets[MEM_LATENCY_BUCKETS];
+} shared_latency_hist_t, *shared_latency_hist_pt;
+
+typedef struct _profile_sample {
+    char *mem; // NULL-empty slot
+    struct _pool_mgr *pool_mgr;
+    size_t size;
+    size_t weight; // allocated bytes the sample stands for
+    unsigned depth;
+    void *stack[MEM_PROFILE_DEPTH];
+} profile_sample_t, *profile_sample_pt;
+
+typedef struct _report_entry {
+    unsigned slot; // in the pool store, as the pool's label
+    alloc_policy policy;
+    pool_stats_t stats;
+} report_entry_t, *report_entry_pt;
+
+typedef struct _layout_cell {
+    size_t alloc_size; // bytes of the cell that are allocated
+    size_t largest; // allocation that overlaps the cell
+} layout_cell_t, *layout_cell_pt;
+
 typedef struct _pool_mgr {
     pool_t pool;
     node_pt node_heap;
     unsigned total_nodes;
     unsigned used_nodes;
+    node_pt tail; // highest-addressed node in the list
+    node_pt free_nodes; // unused nodes below node_hwm, linked through next
+    unsigned node_hwm; // nodes from here on are unused, whatever they contain
     gap_pt gap_ix;
     unsigned gap_ix_capacity;
+    unsigned gap_ix_dirty; // 1-the entries are stale, num_gaps and largest_gap aren't
+    gap_pt gap_scratch; // the radix sort's buffer, allocated on the first rebuild
+    unsigned gap_scratch_capacity; // up to gap_ix_capacity
+    unsigned consecutive_frees; // since the last allocation
+    alloc_ix_entry_pt alloc_ix; // open-addressed by allocation address
+    unsigned alloc_ix_capacity;
+    unsigned alloc_ix_epoch;
+    size_t reserved_size; // 0, unless pool.mem is a PROT_NONE reservation
+    unsigned expandable; // 1-grows by adding extents when no gap fits
+    extent_pt extents; // extents[0] is pool.mem, allocated on first expansion
+    unsigned num_extents;
+    unsigned extents_capacity;
+    size_t purge_threshold; // 0, unless gaps this large are purged on free
+    unsigned max_deferred; // 0, unless frees are deferred until this many
+    unsigned num_deferred; // nodes on the quick lists
+    unsigned quick_list_max; // 0, unless frees go on quick lists up to their caps
+    quick_list_pt quick_lists; // open-addressed by exact size
+    unsigned caller_mem; // 1-pool.mem belongs to the caller, never freed
+    char *meta_block; // region the mgr and initial metadata were carved from
+    size_t meta_block_size;
+    unsigned meta_block_owned; // 1-the meta block was malloc'd, pool.mem included
+    size_t arena_top; // ARENA: offset of the bump pointer
+    size_t arena_last; // ARENA: offset of the most recent allocation
+    unsigned long arena_epoch; // ARENA: changes whenever the bump pointer goes down
+    arena_floor_t arena_floors[MEM_ARENA_FLOORS]; // ARENA: oldest first, tops increasing
+    unsigned num_arena_floors;
+    unsigned tagged; // 1-blocks carry boundary tags in pool.mem, the node heap is unused
+    size_t granule; // BITMAP: bytes per bit
+    size_t num_granules;
+    size_t bitmap_words;
+    uint64_t *bitmap; // BITMAP: 1-granule allocated (bits past the pool are set)
+    uint64_t *bitmap_starts; // BITMAP: 1-granule starts an allocation
+    uint64_t *bitmap_summary; // BITMAP: 1-bitmap word is full
+    unsigned long generation; // changes with the segments, see mem_pool_walk
+    size_t gap_size; // ARENA: unused, the gap is above the bump pointer
+    unsigned gap_histogram[MEM_POOL_HISTOGRAM_BUCKETS]; // by floor(log2(size))
+    atomic_uint stats_seq; // odd while the pool changes, see mem_pool_snapshot
+#ifdef MEM_POOL_COUNTERS
+    pool_counters_t counters;
+#endif
+#ifdef MEM_POOL_LATENCY
+    latency_hist_t latency[POOL_OPS];
+#endif
+#ifdef MEM_POOL_LAYOUT
+    FILE *layout_out; // time-lapse frames go here
+    layout_format layout_fmt;
+    unsigned layout_width;
+    unsigned layout_height;
+    unsigned layout_every; // 0, unless a frame is rendered every this many operations
+    unsigned layout_countdown;
+    unsigned long layout_ops; // allocations and frees since recording started
+    unsigned long layout_frames;
+#endif
 } pool_mgr_t, *pool_mgr_pt;
 
 /***************************/
@@ -69,6 +310,35 @@ typedef struct _pool_mgr {
 static pool_mgr_pt *pool_store = NULL; // an array of pointers, only expand
 static unsigned pool_store_size = 0;
 static unsigned pool_store_capacity = 0;
+static size_t mem_page_size = 0; // cached sysconf(_SC_PAGESIZE)
+// note: held while the store changes, and while the reporter reads the pools
+// in it, so that none is closed under the reporter
+static pthread_mutex_t pool_store_lock = PTHREAD_MUTEX_INITIALIZER;
+// the reporter, if started (see mem_report_start_fd)
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t report_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t report_thread;
+static unsigned report_running = 0;
+static unsigned report_stopping = 0;
+static report_format report_output_format = REPORT_PROMETHEUS;
+static unsigned report_interval_ms = 0;
+static int report_fd = -1; // -1, unless writing to a caller's fd or a connected socket
+static char *report_path = NULL; // the file or socket, if any (owned)
+static unsigned report_to_socket = 0;
+#ifdef MEM_POOL_LATENCY
+static shared_latency_hist_t process_latency[POOL_OPS]; // every pool's, closed ones too
+#endif
+#ifdef MEM_POOL_PROFILE
+// note: held for the index and the random state, i.e. only when a sample is
+// taken, and on a free or a drop while there are samples
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static profile_sample_pt profile_ix = NULL; // open-addressed by allocation address, all pools
+static atomic_uint profile_ix_size = 0; // changes under profile_lock, read without it
+static unsigned profile_ix_capacity = 0;
+static atomic_size_t profile_rate = 0; // 0-off, MEM_PROFILE_DEFAULT_RATE from mem_init
+static atomic_size_t profile_countdown = 0; // bytes until the next sample
+static unsigned long long profile_random = 88172645463325252ull; // xorshift state
+#endif
 
 
 /********************************************/
@@ -79,6 +349,8 @@ static unsigned pool_store_capacity = 0;
 static alloc_status _mem_resize_pool_store();
 static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr);
 static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr);
+static alloc_status _mem_shrink_node_heap(pool_mgr_pt pool_mgr);
+static alloc_status _mem_shrink_gap_ix(pool_mgr_pt pool_mgr);
 static alloc_status
         _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
                            size_t size,
@@ -88,7 +360,110 @@ static alloc_status
                                 size_t size,
                                 node_pt node);
 static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr);
-static alloc_status _mem_invalidate_gap_ix(pool_mgr_pt pool_mgr);
+static void _mem_invalidate_gap_ix(pool_mgr_pt pool_mgr);
+static alloc_status _mem_rebuild_gap_ix(pool_mgr_pt pool_mgr);
+static void _mem_radix_sort_gaps(gap_pt gaps, gap_pt temp, unsigned num_gaps);
+static void _mem_coalesce_deferred(pool_mgr_pt pool_mgr);
+static void _mem_count_gap(pool_mgr_pt pool_mgr, size_t size);
+static void _mem_uncount_gap(pool_mgr_pt pool_mgr, size_t size);
+static void _mem_reset_gap_stats(pool_mgr_pt pool_mgr);
+static unsigned _mem_gap_bucket(size_t size);
+static alloc_status _mem_defer_node(pool_mgr_pt pool_mgr, node_pt node);
+static node_pt _mem_take_deferred(pool_mgr_pt pool_mgr, size_t size);
+static quick_list_pt _mem_find_quick_list(pool_mgr_pt pool_mgr, size_t size, int create);
+static void _mem_reset_quick_lists(pool_mgr_pt pool_mgr);
+static alloc_status _mem_resize_alloc_ix(pool_mgr_pt pool_mgr);
+static void _mem_add_to_alloc_ix(pool_mgr_pt pool_mgr, node_pt node);
+static unsigned _mem_find_in_alloc_ix(pool_mgr_pt pool_mgr, const char *mem);
+static void _mem_remove_from_alloc_ix(pool_mgr_pt pool_mgr, unsigned slot);
+static void _mem_clear_alloc_ix(pool_mgr_pt pool_mgr);
+static unsigned _mem_hash_alloc(pool_mgr_pt pool_mgr, const char *mem);
+static pool_mgr_pt _mem_new_pool_mgr(char *mem, size_t size, alloc_policy policy);
+static pool_mgr_pt _mem_carve_pool_mgr(char *block, size_t block_size, alloc_policy policy);
+static pool_mgr_pt _mem_carve_tagged_pool_mgr(char *block, size_t block_size, alloc_policy policy);
+static void _mem_init_pool_mgr(pool_mgr_pt pool_mgr,
+                               node_pt node_heap,
+                               gap_pt gap_ix,
+                               char *mem,
+                               size_t size,
+                               alloc_policy policy);
+static void _mem_free_pool_mgr(pool_mgr_pt pool_mgr);
+static void _mem_free_meta(pool_mgr_pt pool_mgr, void *meta);
+static int _mem_in_meta_block(pool_mgr_pt pool_mgr, void *meta);
+static size_t _mem_meta_size();
+static size_t _mem_cache_line_round(size_t size);
+static alloc_status _mem_add_to_pool_store(pool_mgr_pt pool_mgr);
+static void * _mem_new_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_del_alloc(pool_mgr_pt pool_mgr, void *alloc);
+static alloc_status _mem_del_alloc_sized(pool_mgr_pt pool_mgr, void *alloc, size_t size);
+static alloc_status _mem_pool_reset(pool_mgr_pt pool_mgr);
+static alloc_status _mem_pool_purge(pool_mgr_pt pool_mgr, size_t min_gap);
+static alloc_status _mem_pool_trim(pool_mgr_pt pool_mgr);
+static void _mem_begin_change(pool_mgr_pt pool_mgr);
+static void _mem_end_change(pool_mgr_pt pool_mgr);
+static void _mem_copy_stats(pool_mgr_pt pool_mgr, pool_stats_t *stats, alloc_policy *policy);
+static void _mem_snapshot_pool(pool_mgr_pt pool_mgr, pool_stats_t *stats, alloc_policy *policy);
+static node_pt _mem_find_gap(pool_mgr_pt pool_mgr, size_t size);
+static node_pt _mem_get_unused_node(pool_mgr_pt pool_mgr);
+static void _mem_put_unused_node(pool_mgr_pt pool_mgr, node_pt node);
+static void * _mem_arena_alloc(pool_mgr_pt pool_mgr, size_t size);
+static void _mem_arena_lower(pool_mgr_pt pool_mgr, size_t top);
+static int _mem_arena_mark_valid(pool_mgr_pt pool_mgr, pool_mark_t mark);
+static void * _mem_tagged_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_tagged_free(pool_mgr_pt pool_mgr, void *alloc);
+static char * _mem_tagged_block(pool_mgr_pt pool_mgr, void *alloc);
+static size_t _mem_tagged_largest(pool_mgr_pt pool_mgr);
+static void _mem_tag_write(char *block, size_t size, unsigned allocated);
+static alloc_status _mem_init_bitmap(pool_mgr_pt pool_mgr, size_t granule);
+static void * _mem_bitmap_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_bitmap_free(pool_mgr_pt pool_mgr, void *alloc);
+static size_t _mem_bitmap_largest(pool_mgr_pt pool_mgr);
+static size_t _mem_bitmap_granule_of(pool_mgr_pt pool_mgr, void *alloc);
+static size_t _mem_bitmap_alloc_end(pool_mgr_pt pool_mgr, size_t first);
+static size_t _mem_bitmap_find(pool_mgr_pt pool_mgr, size_t count);
+static void _mem_bitmap_fill(pool_mgr_pt pool_mgr, size_t first, size_t count, unsigned allocated);
+static size_t _mem_bitmap_next(const uint64_t *map, size_t from, size_t limit, unsigned set);
+static size_t _mem_bitmap_prev_set(const uint64_t *map, size_t before);
+static alloc_status _mem_walk_step(pool_mgr_pt pool_mgr, pool_cursor_t *cursor, pool_record_pt record);
+static alloc_status _mem_expand_pool(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_add_extent(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_release_extent(pool_mgr_pt pool_mgr, node_pt node);
+static alloc_status _mem_purge_gap(pool_mgr_pt pool_mgr, node_pt node);
+static alloc_status _mem_purge_range(pool_mgr_pt pool_mgr, char *mem, size_t size);
+static size_t _mem_page_round(size_t size);
+static size_t _mem_page_trunc(size_t size);
+#ifdef MEM_POOL_LATENCY
+static unsigned long _mem_now_ns();
+static void _mem_record_latency(pool_mgr_pt pool_mgr, pool_op op, unsigned long nanos);
+static latency_hist_pt _mem_latency_hist(pool_mgr_pt pool_mgr, pool_op op, latency_hist_pt copy);
+static unsigned _mem_latency_bucket(unsigned long nanos);
+static unsigned long _mem_latency_bucket_max(unsigned bucket);
+static unsigned long _mem_latency_percentile(latency_hist_pt hist, double percentile);
+#endif
+#ifdef MEM_POOL_PROFILE
+static void _mem_profile_alloc(pool_mgr_pt pool_mgr, char *mem, size_t size);
+static void _mem_profile_free(char *mem);
+static void _mem_profile_drop(pool_mgr_pt pool_mgr, char *from);
+static alloc_status _mem_resize_profile_ix();
+static unsigned _mem_find_in_profile_ix(const char *mem);
+static void _mem_remove_from_profile_ix(unsigned slot);
+static unsigned _mem_hash_profile(const char *mem);
+static size_t _mem_profile_interval();
+static int _mem_compare_stacks(const void *a, const void *b);
+#endif
+static alloc_status _mem_render(pool_mgr_pt pool_mgr, FILE *out, layout_format format,
+                                unsigned width, unsigned height, const char *title);
+static unsigned _mem_layout_class(size_t size);
+#ifdef MEM_POOL_LAYOUT
+static void _mem_layout_tick(pool_mgr_pt pool_mgr);
+#endif
+static void * _mem_report_thread(void *arg);
+static alloc_status _mem_report_start(report_format format, unsigned interval_ms);
+static alloc_status _mem_report_once(report_format format, const char *path, unsigned to_socket, int *fd);
+static alloc_status _mem_format_report(report_format format, char **buffer, size_t *size);
+static alloc_status _mem_write_all(int fd, const char *buffer, size_t size, int is_socket);
+static int _mem_report_connect(const char *path);
+static void _mem_print_report(FILE *out, report_format format, report_entry_pt entries, unsigned num_entries);
 
 
 
@@ -101,12 +476,18 @@ alloc_status mem_init() {
     // ensure that it's called only once until mem_free
     if(!pool_store){
         // allocate the pool store with initial capacity
-        pool_store = (pool_mgr_pt*)calloc(MEM_POOL_STORE_INIT_CAPACITY, sizeof(pool_mgr_pt));
-        if(!pool_store){  // If could not allocate initial capacity //
+        pool_mgr_pt *new_store = (pool_mgr_pt*)calloc(MEM_POOL_STORE_INIT_CAPACITY, sizeof(pool_mgr_pt));
+        if(!new_store){  // If could not allocate initial capacity //
             return ALLOC_FAIL;
         }
+        pthread_mutex_lock(&pool_store_lock);
+        pool_store = new_store;
         pool_store_size = 0;  // pool_store elements used //
         pool_store_capacity = MEM_POOL_STORE_INIT_CAPACITY;  // Initial number of pool_store elements total //
+        pthread_mutex_unlock(&pool_store_lock);
+#ifdef MEM_POOL_PROFILE
+        mem_pool_set_profile_rate(MEM_PROFILE_DEFAULT_RATE);
+#endif
         return ALLOC_OK;
     } else {
         return ALLOC_CALLED_AGAIN;
@@ -124,12 +505,23 @@ alloc_status mem_free() {
                 return ALLOC_NOT_FREED;
             }
         }
-        // can free the pool store array
+        // can free the pool store array (unless the reporter is reading it)
+        pthread_mutex_lock(&pool_store_lock);
         free(pool_store);
         // update static variables
         pool_store = NULL;
         pool_store_size = 0;
         pool_store_capacity = 0;
+        pthread_mutex_unlock(&pool_store_lock);
+#ifdef MEM_POOL_PROFILE
+        // every pool is closed, so no samples are left
+        pthread_mutex_lock(&profile_lock);
+        free(profile_ix);
+        profile_ix = NULL;
+        atomic_store_explicit(&profile_ix_size, 0, memory_order_relaxed);
+        profile_ix_capacity = 0;
+        pthread_mutex_unlock(&profile_lock);
+#endif
         return ALLOC_OK;
     } else {
         return ALLOC_CALLED_AGAIN;
@@ -137,108 +529,253 @@ alloc_status mem_free() {
 }
 
 pool_pt mem_pool_open(size_t size, alloc_policy policy) {
+    MEM_LATENCY_START(start);
     // make sure there the pool store is allocated
     if(!pool_store) return NULL;
-    // expand the pool store, if necessary
-    // ----------LATER---------------//
 
-    // allocate a new mem pool mgr
-    pool_mgr_pt new_mgr = (pool_mgr_pt)calloc(1, sizeof(pool_mgr_t));
+    // allocate the mgr, node heap, gap index and pool memory as a single block
+    // note: aligned_alloc() wants a multiple of the alignment
+    size_t meta_size = _mem_meta_size();
+    if(size == 0 || size > (size_t) -1 - meta_size - MEM_CACHE_LINE_SIZE) return NULL;
+    char * block = (char*)aligned_alloc(MEM_CACHE_LINE_SIZE,
+                                        _mem_cache_line_round(meta_size + size));
     // check success, on error return null
-    if(!new_mgr) return NULL;
+    if(!block) return NULL;
 
-    // allocate a new memory pool
-    void * new_mem = malloc(size);
-    // check success, on error deallocate mgr and return null
-    if(!new_mem) {
-        free(new_mgr);
+    // lay out the block in cache-line aligned sub-regions
+    pool_mgr_pt new_mgr = _mem_carve_pool_mgr(block, meta_size + size, policy);
+    assert(new_mgr);
+    new_mgr->meta_block_owned = 1;
+
+    // a bitmap pool gets its maps, with the default granule
+    if(policy == BITMAP
+       && _mem_init_bitmap(new_mgr, MEM_BITMAP_DEFAULT_GRANULE) != ALLOC_OK) {
+        free(block);
         return NULL;
     }
 
-    // allocate a new node heap
-    node_pt new_heap = (node_pt)calloc(MEM_NODE_HEAP_INIT_CAPACITY, sizeof(node_t));
-    // check success, on error deallocate mgr/pool and return null
-    if(!new_heap) {
-        free(new_mem);
-        free(new_mgr);
+    // link pool mgr to pool store, expanding the store if necessary
+    if(_mem_add_to_pool_store(new_mgr) != ALLOC_OK) {
+        free(new_mgr->bitmap);
+        free(block);
         return NULL;
     }
+    MEM_LATENCY_RECORD(new_mgr, POOL_OP_OPEN, start);
+    MEM_PROBE3(open, new_mgr, new_mgr->pool.total_size, policy);
 
-    // allocate a new gap index
-    gap_pt new_gap = (gap_pt)calloc(MEM_GAP_IX_INIT_CAPACITY, sizeof(gap_t));
-    // check success, on error deallocate mgr/pool/heap and return null
-    if(!new_gap) {
-        free(new_heap);
-        free(new_mem);
-        free(new_mgr);
+    // return the address of the mgr, cast to (pool_pt)
+    return (pool_pt)new_mgr;
+}
+
+pool_pt mem_pool_open_reserved(size_t size, size_t reserve_size, alloc_policy policy) {
+    MEM_LATENCY_START(start);
+    // make sure there the pool store is allocated
+    if(!pool_store) return NULL;
+    // the initial size has to fit in the reservation
+    // note: a bitmap covers a fixed number of granules, so it can't grow
+    if(size == 0 || size > reserve_size || policy == BITMAP) return NULL;
+    reserve_size = _mem_page_round(reserve_size);
+
+    // reserve the address range without backing it with memory
+    char * new_mem = (char*)mmap(NULL, reserve_size, PROT_NONE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(new_mem == MAP_FAILED) return NULL;
+
+    // commit only the pages covering the initial size
+    if(mprotect(new_mem, _mem_page_round(size), PROT_READ | PROT_WRITE) != 0) {
+        munmap(new_mem, reserve_size);
+        return NULL;
+    }
+
+    // allocate a new mem pool mgr, with its node heap and gap index
+    pool_mgr_pt new_mgr = _mem_new_pool_mgr(new_mem, size, policy);
+    if(!new_mgr) {
+        munmap(new_mem, reserve_size);
         return NULL;
     }
-    // assign all the pointers and update meta data:
-    //   initialize top node of node heap
-    new_heap[0].alloc_record.mem = new_mem;
-    new_heap[0].alloc_record.size = size;
-    new_heap[0].used = 1;
-    new_heap[0].allocated = 0;
-    new_heap[0].prev = NULL;
-    new_heap[0].next = NULL;
+    new_mgr->reserved_size = reserve_size;
 
-    //   initialize top node of gap index
-    new_gap[0].size = size;  // Total pool size //
-    new_gap[0].node = new_heap;  // First node in node heap //
+    // link pool mgr to pool store, expanding the store if necessary
+    if(_mem_add_to_pool_store(new_mgr) != ALLOC_OK) {
+        _mem_free_pool_mgr(new_mgr);
+        munmap(new_mem, reserve_size);
+        return NULL;
+    }
+    MEM_LATENCY_RECORD(new_mgr, POOL_OP_OPEN, start);
+    MEM_PROBE3(open, new_mgr, new_mgr->pool.total_size, policy);
 
-    //   initialize pool mgr
-    new_mgr->pool.mem = new_mem;
-    new_mgr->pool.policy = policy;
-    new_mgr->pool.total_size = size;
-    new_mgr->pool.alloc_size = 0;
-    new_mgr->pool.num_allocs = 0;
-    new_mgr->pool.num_gaps = 1;
-    new_mgr->node_heap = new_heap;
-    new_mgr->total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
-    new_mgr->used_nodes = 1;
-    new_mgr->gap_ix = new_gap;
-    new_mgr->gap_ix_capacity = MEM_GAP_IX_INIT_CAPACITY;
-
-    //   link pool mgr to pool store
-    pool_store[pool_store_size] = new_mgr;
-    pool_store_size ++;
+    return (pool_pt)new_mgr;
+}
+
+pool_pt mem_pool_open_expandable(size_t size, alloc_policy policy) {
+    // a bitmap covers a fixed number of granules, so it can't grow
+    if(policy == BITMAP) return NULL;
+
+    // open as usual, the extents are added on demand
+    pool_pt pool = mem_pool_open(size, policy);
+    if(!pool) return NULL;
+
+    ((pool_mgr_pt)pool)->expandable = 1;
+
+    return pool;
+}
+
+pool_pt mem_pool_open_tagged(size_t size, alloc_policy policy) {
+    MEM_LATENCY_START(start);
+    // make sure the pool store is allocated
+    // note: neither arenas nor bitmaps keep per-allocation metadata to tag
+    if(!pool_store || policy == ARENA || policy == BITMAP) return NULL;
+
+    // the pool has to hold at least one block, in whole alignment units
+    size_t total_size = size & ~(MEM_TAG_ALIGN - 1);
+    if(total_size < MEM_TAG_MIN_BLOCK
+       || total_size > (size_t) -1 - sizeof(pool_mgr_t) - 2 * MEM_CACHE_LINE_SIZE) return NULL;
+
+    // allocate the mgr and pool memory as a single block, without a node
+    // heap or gap index, which the tags replace
+    // note: the pool memory starts on a cache line, so blocks are aligned
+    // note: aligned_alloc() wants a multiple of the alignment
+    size_t mgr_size = _mem_cache_line_round(sizeof(pool_mgr_t));
+    char *block = (char*)aligned_alloc(MEM_CACHE_LINE_SIZE,
+                                       _mem_cache_line_round(mgr_size + total_size));
+    if(!block) return NULL;
+    pool_mgr_pt new_mgr = _mem_carve_tagged_pool_mgr(block, mgr_size + total_size, policy);
+    assert(new_mgr);
+    new_mgr->meta_block_owned = 1;
+
+    // link pool mgr to pool store, expanding the store if necessary
+    if(_mem_add_to_pool_store(new_mgr) != ALLOC_OK) {
+        free(block);
+        return NULL;
+    }
+    MEM_LATENCY_RECORD(new_mgr, POOL_OP_OPEN, start);
+    MEM_PROBE3(open, new_mgr, new_mgr->pool.total_size, policy);
+
+    return (pool_pt)new_mgr;
+}
+
+
+pool_pt mem_pool_open_bitmap(size_t size, size_t granule) {
+    // the granule has to be a power of two, and the pool at least one granule
+    if(granule == 0 || (granule & (granule - 1)) || size < granule) return NULL;
+
+    // open without maps, then give it the maps for this granule
+    pool_pt pool = mem_pool_open(size, FIRST_FIT);
+    if(!pool) return NULL;
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    _mem_begin_change(mgr);
+    mgr->pool.policy = BITMAP;
+    alloc_status status = _mem_init_bitmap(mgr, granule);
+    _mem_end_change(mgr);
+    if(status != ALLOC_OK) {
+        mem_pool_close(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+pool_pt mem_pool_open_in(void *buffer, size_t size, alloc_policy policy) {
+    MEM_LATENCY_START(start);
+    // make sure there the pool store is allocated
+    if(!pool_store || !buffer || size == 0) return NULL;
+
+    // allocate a new mem pool mgr, with its node heap and gap index
+    pool_mgr_pt new_mgr = _mem_new_pool_mgr((char*)buffer, size, policy);
+    if(!new_mgr) return NULL;
+    new_mgr->caller_mem = 1;
+    if(policy == BITMAP
+       && _mem_init_bitmap(new_mgr, MEM_BITMAP_DEFAULT_GRANULE) != ALLOC_OK) {
+        _mem_free_pool_mgr(new_mgr);
+        return NULL;
+    }
+
+    // link pool mgr to pool store, expanding the store if necessary
+    if(_mem_add_to_pool_store(new_mgr) != ALLOC_OK) {
+        _mem_free_pool_mgr(new_mgr);
+        return NULL;
+    }
+    MEM_LATENCY_RECORD(new_mgr, POOL_OP_OPEN, start);
+    MEM_PROBE3(open, new_mgr, new_mgr->pool.total_size, policy);
+
+    return (pool_pt)new_mgr;
+}
+
+pool_pt mem_pool_open_embedded(void *buffer, size_t size, alloc_policy policy) {
+    MEM_LATENCY_START(start);
+    // make sure there the pool store is allocated
+    // note: a bitmap would have to be allocated on the heap
+    if(!pool_store || !buffer || policy == BITMAP) return NULL;
+
+    // align the start of the buffer for the mgr
+    char *block = (char*)buffer;
+    size_t padding = _mem_cache_line_round((size_t) block) - (size_t) block;
+    if(size <= padding) return NULL;
+
+    // carve the mgr, node heap and gap index out of the buffer, before the pool
+    pool_mgr_pt new_mgr = _mem_carve_pool_mgr(block + padding, size - padding, policy);
+    if(!new_mgr) return NULL;
+    new_mgr->caller_mem = 1;
+
+    // link pool mgr to pool store, expanding the store if necessary
+    if(_mem_add_to_pool_store(new_mgr) != ALLOC_OK) return NULL;
+    MEM_LATENCY_RECORD(new_mgr, POOL_OP_OPEN, start);
+    MEM_PROBE3(open, new_mgr, new_mgr->pool.total_size, policy);
 
-    // return the address of the mgr, cast to (pool_pt)
     return (pool_pt)new_mgr;
 }
 
 alloc_status mem_pool_close(pool_pt pool) {
+    MEM_LATENCY_START(start);
     // get mgr from pool by casting the pointer to (pool_mgr_pt)
     pool_mgr_pt mgr = (pool_mgr_pt)pool;
     // check if this pool is allocated
     if(mgr->pool.alloc_size > 0) {
         return ALLOC_NOT_FREED;
     }
-    // check if pool has only one gap
-    if(mgr->pool.num_gaps > 1) {
+    // coalesce any deferred frees, so the gaps can be counted
+    if(mgr->num_deferred) {
+        _mem_begin_change(mgr);
+        _mem_coalesce_deferred(mgr);
+        _mem_end_change(mgr);
+    }
+    // check if pool has only one gap (per extent)
+    if(mgr->pool.num_gaps > mgr->num_extents) {
         return ALLOC_NOT_FREED;
     }
     // check if it has zero allocations
     if(mgr->pool.num_allocs > 0) {
         return ALLOC_NOT_FREED;
     }
-    // free memory pool
-    free(mgr->pool.mem);
-    // free node heap
-    free(mgr->node_heap);
-    // free gap index
-    free(mgr->gap_ix);
+    // free the extents added on expansion
+    for(unsigned i = 1; i < mgr->num_extents; ++i) {
+        free(mgr->extents[i].mem);
+    }
+    free(mgr->extents);
+    // free memory pool (or release the whole reservation)
+    // note: memory in the meta block goes with it, below
+    if(mgr->reserved_size) {
+        munmap(mgr->pool.mem, mgr->reserved_size);
+    } else if(!mgr->caller_mem && !_mem_in_meta_block(mgr, mgr->pool.mem)) {
+        free(mgr->pool.mem);
+    }
     // find mgr in pool store and set to null
     // note: don't decrement pool_store_size, because it only grows
+    pthread_mutex_lock(&pool_store_lock);
     for(int i = 0; i < pool_store_capacity; ++i){
         if(pool_store[i] == mgr){
             pool_store[i] = NULL;
             break;
         }
     }
+    pthread_mutex_unlock(&pool_store_lock);
 
-    // free mgr
-    free(mgr);
+    // free node heap, gap index and mgr (with the meta block, if owned)
+    MEM_PROBE1(close, mgr);
+    MEM_PROFILE_DROP(mgr, NULL);
+    _mem_free_pool_mgr(mgr);
+    // note: the pool is gone, so only the process counts the close
+    MEM_LATENCY_RECORD(NULL, POOL_OP_CLOSE, start);
 
     return ALLOC_OK;
 }
@@ -246,216 +783,587 @@ alloc_status mem_pool_close(pool_pt pool) {
 void * mem_new_alloc(pool_pt pool, size_t size) {
     // get mgr from pool by casting the pointer to (pool_mgr_pt)
     pool_mgr_pt mgr = (pool_mgr_pt)pool;
-    // check if any gaps, return null if none
-    if(!mgr->gap_ix) return NULL;
 
-    // expand heap node, if necessary, quit on error
-    alloc_status status = ALLOC_FAIL;
-    // --------------LATER----------//
-    // check used nodes fewer than total nodes, quit on error
-    if(mgr->used_nodes >= mgr->total_nodes) return NULL;
+    // readers of mem_pool_snapshot retry while the pool changes
+    MEM_LATENCY_START(start);
+    _mem_begin_change(mgr);
+    void *alloc = _mem_new_alloc(mgr, size);
+    _mem_end_change(mgr);
+    MEM_LATENCY_RECORD(mgr, POOL_OP_ALLOC, start);
+    MEM_PROBE3(alloc, mgr, size, alloc);
+    if(alloc) MEM_PROFILE_ALLOC(mgr, alloc, size);
+    // note: counted only with MEM_POOL_COUNTERS
+    MEM_COUNT(mgr, allocs, 1);
+    if(!alloc) MEM_COUNT(mgr, alloc_failures, 1);
+    MEM_LAYOUT_TICK(mgr);
 
-    // get a node for allocation:
-    node_pt gap_node = NULL;
-    // if FIRST_FIT, then find the first sufficient node in the node heap
-    if(mgr->pool.policy == FIRST_FIT) {
-        node_pt current_node = mgr->node_heap;
-        while(current_node) {
-            if(current_node->allocated == 0 && current_node->alloc_record.size >= size) {
-                gap_node = current_node;  // Found node //
-                break;
-            }
-            current_node = current_node->next;
-        }
-    }
-    // if BEST_FIT, then find the first sufficient node in the gap index
-    else {
-        gap_pt gap_ix = mgr->gap_ix;  // sorted in order of increasing size //
-        for(int i = 0; i < pool->num_gaps; ++i){
-            if(gap_ix[i].size >= size) {
-                gap_node = gap_ix[i].node;  // Found node //
-                break;
-            }
-        }
-    }
-    // check if node found
-    if(!gap_node) return NULL;  // No gap node found //
+    return alloc;
+}
 
-    // update metadata (num_allocs, alloc_size)
-    mgr->pool.num_allocs ++;
-    mgr->pool.alloc_size += size;
+alloc_status mem_del_alloc(pool_pt pool, void * alloc) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
 
-    // calculate the size of the remaining gap, if any
-    size_t remaining_gap = gap_node->alloc_record.size - size;
+    MEM_LATENCY_START(start);
+    _mem_begin_change(mgr);
+    alloc_status status = _mem_del_alloc(mgr, alloc);
+    _mem_end_change(mgr);
+    MEM_LATENCY_RECORD(mgr, POOL_OP_FREE, start);
+    MEM_PROBE3(free, mgr, alloc, status);
+    if(status == ALLOC_OK) MEM_PROFILE_FREE(alloc);
+    // note: counted only with MEM_POOL_COUNTERS
+    MEM_COUNT(mgr, frees, 1);
+    if(status != ALLOC_OK) MEM_COUNT(mgr, free_failures, 1);
+    MEM_LAYOUT_TICK(mgr);
 
-    // remove node from gap index
-    status = _mem_remove_from_gap_ix(mgr, gap_node->alloc_record.size, gap_node);
-    assert(status == ALLOC_OK);
+    return status;
+}
 
-    // convert gap_node to an allocation node of given size
-    gap_node->allocated = 1;
-    gap_node->alloc_record.size = size;
+alloc_status mem_pool_reset(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
 
-    // adjust node heap:
-    //   if remaining gap, need a new node
-    if(remaining_gap > 0){
-        //   find an unused one in the node heap
-        node_pt new_gap_node = NULL;
-        node_pt current_node = mgr->node_heap;
-        for(int i = 0; i < mgr->total_nodes; ++i) {
-            if(current_node[i].used == 0) {
-                new_gap_node = &current_node[i];
-                break;
-            }
-        }
-        //   make sure one was found
-        if(!new_gap_node) return NULL;
+    _mem_begin_change(mgr);
+    alloc_status status = _mem_pool_reset(mgr);
+    _mem_end_change(mgr);
 
-        //   initialize it to a gap node
-        new_gap_node->used = 1;
-        new_gap_node->allocated = 0;
-        new_gap_node->alloc_record.mem = gap_node->alloc_record.mem + size;
-        new_gap_node->alloc_record.size = remaining_gap;
+    return status;
+}
 
-        //   update metadata (used_nodes)
-        mgr->used_nodes += 1;
+pool_mark_t mem_pool_mark(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    pool_mark_t mark;
 
-        //   update linked list (new node right after the node for allocation)
-        new_gap_node->next = gap_node->next;
-        if(gap_node->next) gap_node->next->prev = new_gap_node;
-        new_gap_node->prev = gap_node;
-        gap_node->next = new_gap_node;
+    // only arenas allocate in stack order, other pools get an invalid mark
+    mark.top = (mgr->pool.policy == ARENA) ? mgr->arena_top : (size_t) -1;
+    mark.last = mgr->arena_last;
+    mark.alloc_size = mgr->pool.alloc_size;
+    mark.num_allocs = mgr->pool.num_allocs;
+    mark.epoch = mgr->arena_epoch;
 
-        //   add to gap index
-        status = _mem_add_to_gap_ix(mgr, remaining_gap, new_gap_node);
-        //   check if successful
-        assert(status == ALLOC_OK);
-        // ----------- LATER ------------//
-        /*if(status != ALLOC_OK) {
-            status = _mem_resize_gap_ix(mgr);
-            assert(status == ALLOC_OK);
-            if(status == ALLOC_OK) status = _mem_add_to_gap_ix(mgr, remaining_gap, new_gap_node);
-        }*/
+    return mark;
+}
+
+alloc_status mem_pool_rewind(pool_pt pool, pool_mark_t mark) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    // the mark has to be from this arena, not above the bump pointer, and
+    // the bump pointer can't have gone below it since (by a rewind, a reset
+    // or a free), even if it went back up again
+    if(mgr->pool.policy != ARENA
+       || mark.top > mgr->arena_top
+       || mark.num_allocs > mgr->pool.num_allocs
+       || mark.alloc_size > mgr->pool.alloc_size
+       || !_mem_arena_mark_valid(mgr, mark)) return ALLOC_FAIL;
+
+    // everything allocated since the mark goes at once
+    // note: saved walk positions don't survive it
+    MEM_PROFILE_DROP(mgr, mgr->pool.mem + mark.top);
+    mgr->generation ++;
+    _mem_begin_change(mgr);
+    _mem_arena_lower(mgr, mark.top);
+    mgr->arena_top = mark.top;
+    mgr->arena_last = mark.last;
+    mgr->pool.alloc_size = mark.alloc_size;
+    mgr->pool.num_allocs = mark.num_allocs;
+    mgr->pool.num_gaps = (mark.top < mgr->pool.total_size) ? 1 : 0;
+    mgr->pool.largest_gap = mgr->pool.total_size - mark.top;
+    _mem_end_change(mgr);
+
+    return ALLOC_OK;
+}
+
+alloc_status mem_pool_purge(pool_pt pool, size_t min_gap) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    _mem_begin_change(mgr);
+    alloc_status status = _mem_pool_purge(mgr, min_gap);
+    _mem_end_change(mgr);
+
+    return status;
+}
+
+alloc_status mem_pool_set_purge_threshold(pool_pt pool, size_t min_gap) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    // from now on, mem_del_alloc purges any gap of at least min_gap
+    mgr->purge_threshold = min_gap;
+
+    // catch up with the gaps that are already there
+    return min_gap ? mem_pool_purge(pool, min_gap) : ALLOC_OK;
+}
+
+alloc_status mem_pool_set_deferred(pool_pt pool, unsigned max_deferred) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    // only node pools coalesce on free
+    if(mgr->pool.policy == ARENA || mgr->pool.policy == BITMAP || mgr->tagged) return ALLOC_FAIL;
+
+    // the quick lists are allocated when first needed
+    if(max_deferred && !mgr->quick_lists) {
+        mgr->quick_lists = (quick_list_pt)calloc(MEM_QUICK_LISTS, sizeof(quick_list_t));
+        if(!mgr->quick_lists) return ALLOC_FAIL;
     }
+    // saved walk positions don't survive a change
+    mgr->generation ++;
+    mgr->max_deferred = max_deferred;
 
-    // return allocation record by casting the node to (alloc_pt)
-    return gap_node->alloc_record.mem;
+    // catch up with the frees that are already deferred, if too many now
+    if(mgr->num_deferred && mgr->num_deferred >= max_deferred) {
+        _mem_begin_change(mgr);
+        _mem_coalesce_deferred(mgr);
+        _mem_end_change(mgr);
+    }
+
+    return ALLOC_OK;
 }
 
-alloc_status mem_del_alloc(pool_pt pool, void * alloc) {
+alloc_status mem_pool_set_quick_lists(pool_pt pool, unsigned max_per_size) {
     // get mgr from pool by casting the pointer to (pool_mgr_pt)
     pool_mgr_pt mgr = (pool_mgr_pt) pool;
 
-    // get node from alloc by casting the pointer to (node_pt)
-    node_pt delete_node = NULL;
-    // find the node in the node heap
-    for(int i = 0; i < mgr->total_nodes; ++i) {
-        // this is node-to-delete
-        if(mgr->node_heap[i].alloc_record.mem == alloc) {
-            delete_node = &mgr->node_heap[i];
-            break;
-        }
+    // only node pools search for gaps
+    if(mgr->pool.policy == ARENA || mgr->pool.policy == BITMAP || mgr->tagged) return ALLOC_FAIL;
+
+    // the quick lists are allocated when first needed
+    if(max_per_size && !mgr->quick_lists) {
+        mgr->quick_lists = (quick_list_pt)calloc(MEM_QUICK_LISTS, sizeof(quick_list_t));
+        if(!mgr->quick_lists) return ALLOC_FAIL;
     }
+    // saved walk positions don't survive a change
+    mgr->generation ++;
+    mgr->quick_list_max = max_per_size;
 
-    // make sure it's found
-    if(!delete_node) return ALLOC_FAIL;
+    // flush the lists when turned off, the caps start over
+    if(!max_per_size && mgr->num_deferred && !mgr->max_deferred) {
+        _mem_begin_change(mgr);
+        _mem_coalesce_deferred(mgr);
+        _mem_end_change(mgr);
+    }
+    if(mgr->quick_lists && !mgr->num_deferred) _mem_reset_quick_lists(mgr);
 
-    // convert to gap node
-    delete_node->allocated = 0;
+    return ALLOC_OK;
+}
 
-    // update metadata (num_allocs, alloc_size)
-    mgr->pool.num_allocs --;
-    mgr->pool.alloc_size -= delete_node->alloc_record.size;
+alloc_status mem_pool_trim(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
 
-    alloc_status status = ALLOC_FAIL;
+    _mem_begin_change(mgr);
+    alloc_status status = _mem_pool_trim(mgr);
+    _mem_end_change(mgr);
 
-    // if the next node in the list is also a gap, merge into node-to-delete
-    if(delete_node->next && delete_node->next->used ==  1 && delete_node->next->allocated == 0) {
-        //   remove the next node from gap index
-        status = _mem_remove_from_gap_ix(mgr,delete_node->next->alloc_record.size, delete_node->next);
-        //   check success
-        assert(status == ALLOC_OK);
-        //   add the size to the node-to-delete
-        delete_node->alloc_record.size += delete_node->next->alloc_record.size;
-        //   update node as unused
-        delete_node->next->used = 0;
-        //   update metadata (used nodes)
-        mgr->used_nodes --;
+    return status;
+}
 
-        //   update linked list:
-        /*
-                        if (next->next) {
-                            next->next->prev = node_to_del;
-                            node_to_del->next = next->next;
-                        } else {
-                            node_to_del->next = NULL;
-                        }
-                        next->next = NULL;
-                        next->prev = NULL;
-         */
-        node_pt next = delete_node->next;
-        if(next->next) {  // Not end of list //
-            next->next->prev = delete_node;
-            delete_node->next = next->next;
-        } else {
-            delete_node->next = NULL;
+alloc_status mem_del_alloc_sized(pool_pt pool, void *alloc, size_t size) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    // instrumented as mem_del_alloc
+    MEM_LATENCY_START(start);
+    _mem_begin_change(mgr);
+    alloc_status status = _mem_del_alloc_sized(mgr, alloc, size);
+    _mem_end_change(mgr);
+    MEM_LATENCY_RECORD(mgr, POOL_OP_FREE, start);
+    MEM_PROBE3(free, mgr, alloc, status);
+    if(status == ALLOC_OK) MEM_PROFILE_FREE(alloc);
+    // note: counted only with MEM_POOL_COUNTERS
+    MEM_COUNT(mgr, frees, 1);
+    if(status != ALLOC_OK) MEM_COUNT(mgr, free_failures, 1);
+    MEM_LAYOUT_TICK(mgr);
+
+    return status;
+}
+
+alloc_status mem_pool_walk(pool_pt pool,
+                           pool_cursor_t *cursor,
+                           walk_filter filter,
+                           pool_record_pt record) {
+    // get the mgr from the pool
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    // step through the segments until one passes the filter
+    // note: nothing is allocated, the cursor holds the position
+    while(!cursor->done) {
+        pool_record_t segment;
+        if(_mem_walk_step(mgr, cursor, &segment) != ALLOC_OK) {
+            cursor->done = 1;
+            break;
+        }
+        if(filter == WALK_ALL
+           || (filter == WALK_ALLOCS && segment.allocated)
+           || (filter == WALK_GAPS && !segment.allocated)) {
+            *record = segment;
+            return ALLOC_OK;
         }
-        next->next = NULL;
-        next->prev = NULL;
     }
 
-    // this merged node-to-delete might need to be added to the gap index
-    // but one more thing to check...
-    // if the previous node in the list is also a gap, merge into previous!
-    if(delete_node->prev && delete_node->prev->used ==  1 && delete_node->prev->allocated == 0) {
-        //   remove the previous node from gap index
-        status = _mem_remove_from_gap_ix(mgr, delete_node->prev->alloc_record.size, delete_node->prev);
-        //   check success
-        assert(status == ALLOC_OK);
-        //   add the size of node-to-delete to the previous
-        delete_node->prev->alloc_record.size += delete_node->alloc_record.size;
-        //   update node-to-delete as unused
-        delete_node->used = 0;
-        //   update metadata (used_nodes)
-        mgr->used_nodes--;
-        //   update linked list
-        /*
-                        if (node_to_del->next) {
-                            prev->next = node_to_del->next;
-                            node_to_del->next->prev = prev;
-                        } else {
-                            prev->next = NULL;
-                        }
-                        node_to_del->next = NULL;
-                        node_to_del->prev = NULL;
-         */
-        node_pt prev = delete_node->prev;
-        if (delete_node->next) {
-            prev->next = delete_node->next;
-            delete_node->next->prev = prev;
-        } else {
-            prev->next = NULL;
+    return ALLOC_FAIL;
+}
+
+pool_stats_t mem_pool_stats(pool_pt pool) {
+    // get the mgr from the pool
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    pool_stats_t stats;
+
+    // the owner sees no changes under way, so a plain copy will do
+    _mem_copy_stats(mgr, &stats, NULL);
+
+    return stats;
+}
+
+alloc_status mem_pool_snapshot(pool_pt pool, pool_stats_t *stats) {
+    // get the mgr from the pool
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    _mem_snapshot_pool(mgr, stats, NULL);
+
+    return ALLOC_OK;
+}
+
+alloc_status mem_pool_counters(pool_pt pool, pool_counters_t *counters) {
+#ifdef MEM_POOL_COUNTERS
+    // get the mgr from the pool
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    *counters = mgr->counters;
+
+    return ALLOC_OK;
+#else
+    (void) pool; /* unused */
+    memset(counters, 0, sizeof(*counters));
+
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_pool_latency(pool_pt pool, pool_op op, double percentile, unsigned long *nanos) {
+#ifdef MEM_POOL_LATENCY
+    if(op >= POOL_OPS) return ALLOC_FAIL;
+    // a pool's own histogram, or a copy of the process's
+    latency_hist_t copy;
+    latency_hist_pt hist = _mem_latency_hist((pool_mgr_pt) pool, op, &copy);
+    if(!hist->count) return ALLOC_FAIL;
+    *nanos = _mem_latency_percentile(hist, percentile);
+
+    return ALLOC_OK;
+#else
+    (void) pool; /* unused */
+    (void) op; /* unused */
+    (void) percentile; /* unused */
+    *nanos = 0;
+
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_pool_dump_latency(pool_pt pool, FILE *out) {
+#ifdef MEM_POOL_LATENCY
+    static const char *op_names[POOL_OPS] = { "alloc", "free", "open", "close" };
+    static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+    static const unsigned num_percentiles = sizeof(percentiles) / sizeof(percentiles[0]);
+
+    fprintf(out, "%-6s %12s %10s %10s %10s %10s %10s (ns)\n",
+            "op", "count", "p50", "p90", "p99", "p99.9", "max");
+    latency_hist_t copy;
+    for(unsigned op = 0; op < POOL_OPS; ++op) {
+        latency_hist_pt hist = _mem_latency_hist((pool_mgr_pt) pool, (pool_op) op, &copy);
+        if(!hist->count) continue;
+        fprintf(out, "%-6s %12lu", op_names[op], hist->count);
+        for(unsigned i = 0; i < num_percentiles; ++i) {
+            fprintf(out, " %10lu", _mem_latency_percentile(hist, percentiles[i]));
         }
-        delete_node->next = NULL;
-        delete_node->prev = NULL;
+        fprintf(out, " %10lu\n", hist->max);
+    }
 
-        //   change the node to add to the previous node!
-        delete_node = prev;
+    return ALLOC_OK;
+#else
+    (void) pool; /* unused */
+    (void) out; /* unused */
+
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_pool_set_profile_rate(size_t bytes) {
+#ifdef MEM_POOL_PROFILE
+    // the next sample is taken about this many bytes from now
+    pthread_mutex_lock(&profile_lock);
+    atomic_store_explicit(&profile_rate, bytes, memory_order_relaxed);
+    atomic_store_explicit(&profile_countdown, bytes ? _mem_profile_interval() : 0, memory_order_relaxed);
+    pthread_mutex_unlock(&profile_lock);
+
+    return ALLOC_OK;
+#else
+    (void) bytes; /* unused */
+
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_pool_dump_profile(pool_pt pool, FILE *out) {
+#ifdef MEM_POOL_PROFILE
+    // gather the pool's live samples, then sort them by call stack
+    // note: the lock is held to the end, as the samples point into the index
+    pthread_mutex_lock(&profile_lock);
+    profile_sample_pt *samples =
+            (profile_sample_pt *)malloc((profile_ix_size + 1) * sizeof(profile_sample_pt));
+    if(!samples) {
+        pthread_mutex_unlock(&profile_lock);
+        return ALLOC_FAIL;
+    }
+    unsigned num_samples = 0;
+    unsigned long total_count = 0, total_bytes = 0;
+    for(unsigned i = 0; i < profile_ix_capacity; ++i) {
+        if(!profile_ix[i].mem || (pool && profile_ix[i].pool_mgr != (pool_mgr_pt) pool)) continue;
+        samples[num_samples ++] = &profile_ix[i];
+        total_count += profile_ix[i].weight / profile_ix[i].size;
+        total_bytes += profile_ix[i].weight;
     }
+    qsort(samples, num_samples, sizeof(profile_sample_pt), _mem_compare_stacks);
 
-        // add the resulting node to the gap index
-        status = _mem_add_to_gap_ix(mgr, delete_node->alloc_record.size, delete_node);
-        // check success
-        assert(status == ALLOC_OK);
+    // pprof's legacy heap profile: estimated live objects and bytes, in
+    // total and per call stack (only live samples are kept, so the
+    // allocated-space columns are 0)
+    fprintf(out, "heap profile: %lu: %lu [0: 0] @ heap\n", total_count, total_bytes);
+    for(unsigned i = 0; i < num_samples; ) {
+        unsigned long count = 0, bytes = 0;
+        unsigned j = i;
+        for(; j < num_samples && _mem_compare_stacks(&samples[i], &samples[j]) == 0; ++j) {
+            count += samples[j]->weight / samples[j]->size;
+            bytes += samples[j]->weight;
+        }
+        fprintf(out, "%lu: %lu [0: 0] @", count, bytes);
+        for(unsigned k = 0; k < samples[i]->depth; ++k) fprintf(out, " %p", samples[i]->stack[k]);
+        fprintf(out, "\n");
+        i = j;
+    }
+    free(samples);
+    pthread_mutex_unlock(&profile_lock);
+
+    // pprof symbolizes the addresses with the mappings
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if(maps) {
+        char line[512];
+        fprintf(out, "\nMAPPED_LIBRARIES:\n");
+        while(fgets(line, sizeof(line), maps)) fputs(line, out);
+        fclose(maps);
+    }
+
+    return ALLOC_OK;
+#else
+    (void) pool; /* unused */
+    (void) out; /* unused */
+
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_pool_render(pool_pt pool, FILE *out, layout_format format, unsigned width, unsigned height) {
+    // get the mgr from the pool
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    return _mem_render(mgr, out, format, width, height, NULL);
+}
+
+alloc_status mem_pool_record_layout(pool_pt pool, FILE *out, layout_format format,
+                                    unsigned width, unsigned height, unsigned every_ops) {
+#ifdef MEM_POOL_LAYOUT
+    // get the mgr from the pool
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    // check the frame size up front, rather than on every frame
+    size_t num_cells = (size_t) width * height;
+    if(every_ops && (!out || num_cells == 0 || num_cells > MEM_LAYOUT_MAX_CELLS)) return ALLOC_FAIL;
+
+    // 0 stops recording, the frames so far stay in out
+    mgr->layout_out = every_ops ? out : NULL;
+    mgr->layout_fmt = format;
+    mgr->layout_width = width;
+    mgr->layout_height = height;
+    mgr->layout_every = every_ops;
+    mgr->layout_countdown = every_ops;
+    mgr->layout_ops = 0;
+    mgr->layout_frames = 0;
+
+    return ALLOC_OK;
+#else
+    (void) pool; /* unused */
+    (void) out; /* unused */
+    (void) format; /* unused */
+    (void) width; /* unused */
+    (void) height; /* unused */
+    (void) every_ops; /* unused */
+
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_report_write(int fd, report_format format) {
+    // a one-off report, as the reporter thread would write it
+    char *buffer = NULL;
+    size_t size = 0;
+    if(_mem_format_report(format, &buffer, &size) != ALLOC_OK) return ALLOC_FAIL;
+    alloc_status status = _mem_write_all(fd, buffer, size, 0);
+    free(buffer);
+
+    return status;
+}
+
+alloc_status mem_report_start_fd(int fd, report_format format, unsigned interval_ms) {
+    if(fd < 0) return ALLOC_FAIL;
+    pthread_mutex_lock(&report_lock);
+    if(report_running) {
+        pthread_mutex_unlock(&report_lock);
+        return ALLOC_CALLED_AGAIN;
+    }
+    report_fd = fd;
+    report_path = NULL;
+    report_to_socket = 0;
+    alloc_status status = _mem_report_start(format, interval_ms);
+    pthread_mutex_unlock(&report_lock);
+
+    return status;
+}
+
+alloc_status mem_report_start_file(const char *path, report_format format, unsigned interval_ms) {
+    if(!path) return ALLOC_FAIL;
+    pthread_mutex_lock(&report_lock);
+    if(report_running) {
+        pthread_mutex_unlock(&report_lock);
+        return ALLOC_CALLED_AGAIN;
+    }
+    report_fd = -1;
+    report_path = strdup(path);
+    report_to_socket = 0;
+    alloc_status status = report_path ? _mem_report_start(format, interval_ms) : ALLOC_FAIL;
+    pthread_mutex_unlock(&report_lock);
+
+    return status;
+}
+
+alloc_status mem_report_start_socket(const char *path, report_format format, unsigned interval_ms) {
+    // the path has to fit in a socket address
+    if(!path || strlen(path) >= MEM_REPORT_MAX_PATH) return ALLOC_FAIL;
+    pthread_mutex_lock(&report_lock);
+    if(report_running) {
+        pthread_mutex_unlock(&report_lock);
+        return ALLOC_CALLED_AGAIN;
+    }
+    // note: the thread connects, so a listener can come up later
+    report_fd = -1;
+    report_path = strdup(path);
+    report_to_socket = 1;
+    alloc_status status = report_path ? _mem_report_start(format, interval_ms) : ALLOC_FAIL;
+    pthread_mutex_unlock(&report_lock);
 
     return status;
 }
 
+alloc_status mem_report_stop() {
+    // wake the thread up and wait for it to finish the report it's writing
+    pthread_mutex_lock(&report_lock);
+    if(!report_running) {
+        pthread_mutex_unlock(&report_lock);
+        return ALLOC_FAIL;
+    }
+    report_stopping = 1;
+    pthread_cond_signal(&report_wakeup);
+    pthread_mutex_unlock(&report_lock);
+    pthread_join(report_thread, NULL);
+
+    // close the socket, but not the caller's fd
+    pthread_mutex_lock(&report_lock);
+    if(report_to_socket && report_fd >= 0) close(report_fd);
+    report_fd = -1;
+    free(report_path);
+    report_path = NULL;
+    report_to_socket = 0;
+    report_running = 0;
+    report_stopping = 0;
+    pthread_mutex_unlock(&report_lock);
+
+    return ALLOC_OK;
+}
+
 void mem_inspect_pool(pool_pt pool,
                       pool_segment_pt *segments,
                       unsigned *num_segments) {
     // get the mgr from the pool
     pool_mgr_pt  mgr = (pool_mgr_pt) pool;
+
+    // an arena has no nodes: all allocations are one segment, then the gap
+    if(mgr->pool.policy == ARENA) {
+        pool_segment_pt segs = (pool_segment_pt)calloc(2, sizeof(pool_segment_t));
+        assert(segs);
+        unsigned num_segs = 0;
+        if(mgr->arena_top > 0) {
+            segs[num_segs].size = mgr->arena_top;
+            segs[num_segs].allocated = 1;
+            num_segs ++;
+        }
+        if(mgr->arena_top < mgr->pool.total_size) {
+            segs[num_segs].size = mgr->pool.total_size - mgr->arena_top;
+            segs[num_segs].allocated = 0;
+            num_segs ++;
+        }
+        *segments = segs;
+        *num_segments = num_segs;
+        return;
+    }
+    // a bitmap is walked twice, to count the runs and to record them
+    // note: adjacent allocations are told apart by their start bits
+    if(mgr->pool.policy == BITMAP) {
+        pool_segment_pt segs = NULL;
+        unsigned num_segs = 0;
+        for(int pass = 0; pass < 2; ++pass) {
+            if(pass) {
+                segs = (pool_segment_pt)calloc(num_segs, sizeof(pool_segment_t));
+                assert(segs);
+                num_segs = 0;
+            }
+            size_t first = 0;
+            while(first < mgr->num_granules) {
+                unsigned allocated = (mgr->bitmap[first / MEM_BITMAP_WORD_BITS]
+                                      >> (first % MEM_BITMAP_WORD_BITS)) & 1;
+                size_t end = allocated
+                             ? _mem_bitmap_alloc_end(mgr, first)
+                             : _mem_bitmap_next(mgr->bitmap, first, mgr->num_granules, 1);
+                if(pass) {
+                    segs[num_segs].size = (end - first) * mgr->granule;
+                    segs[num_segs].allocated = allocated;
+                }
+                num_segs ++;
+                first = end;
+            }
+        }
+        *segments = segs;
+        *num_segments = num_segs;
+        return;
+    }
+    // a tagged pool is walked twice, to count the blocks and to record them
+    if(mgr->tagged) {
+        char *end = mgr->pool.mem + mgr->pool.total_size;
+        unsigned num_segs = 0;
+        for(char *block = mgr->pool.mem; block < end; block += *(size_t *) block & ~(size_t) 1) {
+            num_segs ++;
+        }
+        pool_segment_pt segs = (pool_segment_pt)calloc(num_segs, sizeof(pool_segment_t));
+        assert(segs);
+        unsigned i = 0;
+        for(char *block = mgr->pool.mem; block < end; block += *(size_t *) block & ~(size_t) 1) {
+            segs[i].size = *(size_t *) block & ~(size_t) 1;
+            segs[i].allocated = *(size_t *) block & 1;
+            ++i;
+        }
+        *segments = segs;
+        *num_segments = num_segs;
+        return;
+    }
     // allocate the segments array with size == used_nodes
     pool_segment_pt segs = (pool_segment_pt)calloc(mgr->used_nodes, sizeof(pool_segment_t));
     // check successful
@@ -487,25 +1395,158 @@ void mem_inspect_pool(pool_pt pool,
 /***********************************/
 static alloc_status _mem_resize_pool_store() {
     // check if necessary
-    /*
-                if (((float) pool_store_size / pool_store_capacity)
-                    > MEM_POOL_STORE_FILL_FACTOR) {...}
-     */
+    if(((float) pool_store_size / pool_store_capacity)
+       <= MEM_POOL_STORE_FILL_FACTOR) return ALLOC_OK;
+
+    unsigned new_capacity = pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR;
+    pool_mgr_pt *new_store =
+            (pool_mgr_pt*)realloc(pool_store, new_capacity * sizeof(pool_mgr_pt));
+    if(!new_store) return ALLOC_FAIL;
+    // zero out the new slots, as mem_free() checks all of them
+    memset(new_store + pool_store_capacity, 0,
+           (new_capacity - pool_store_capacity) * sizeof(pool_mgr_pt));
+
     // don't forget to update capacity variables
+    pool_store = new_store;
+    pool_store_capacity = new_capacity;
 
-    return ALLOC_FAIL;
+    return ALLOC_OK;
 }
 
 static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr) {
-    // see above
+    // check if necessary
+    if(((float) pool_mgr->used_nodes / pool_mgr->total_nodes)
+       <= MEM_NODE_HEAP_FILL_FACTOR) return ALLOC_OK;
 
-    return ALLOC_FAIL;
+    unsigned new_total = pool_mgr->total_nodes * MEM_NODE_HEAP_EXPAND_FACTOR;
+    node_pt old_heap = pool_mgr->node_heap;
+    node_pt new_heap = (node_pt)calloc(new_total, sizeof(node_t));
+    if(!new_heap) return ALLOC_FAIL;
+    memcpy(new_heap, old_heap, pool_mgr->total_nodes * sizeof(node_t));
+
+    // the nodes moved, so rebase the list links, the tail and the gap index
+    for(unsigned i = 0; i < pool_mgr->total_nodes; ++i) {
+        if(old_heap[i].next) new_heap[i].next = new_heap + (old_heap[i].next - old_heap);
+        if(old_heap[i].prev) new_heap[i].prev = new_heap + (old_heap[i].prev - old_heap);
+    }
+    pool_mgr->tail = new_heap + (pool_mgr->tail - old_heap);
+    if(pool_mgr->free_nodes) pool_mgr->free_nodes = new_heap + (pool_mgr->free_nodes - old_heap);
+    // note: a stale gap index is rebuilt from the list anyway
+    for(unsigned i = 0; !pool_mgr->gap_ix_dirty && i < pool_mgr->pool.num_gaps; ++i) {
+        pool_mgr->gap_ix[i].node = new_heap + (pool_mgr->gap_ix[i].node - old_heap);
+    }
+    _mem_free_meta(pool_mgr, old_heap);
+
+    // don't forget to update capacity variables
+    pool_mgr->node_heap = new_heap;
+    pool_mgr->total_nodes = new_total;
+    MEM_COUNT(pool_mgr, node_heap_growths, 1);
+    MEM_PROBE2(node_heap_grow, pool_mgr, new_total);
+
+    return ALLOC_OK;
 }
 
 static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr) {
-    // see above
+    // check if necessary
+    if(((float) pool_mgr->pool.num_gaps / pool_mgr->gap_ix_capacity)
+       <= MEM_GAP_IX_FILL_FACTOR) return ALLOC_OK;
 
-    return ALLOC_FAIL;
+    // gap entries only point at nodes, so they can be moved freely
+    unsigned new_capacity = pool_mgr->gap_ix_capacity * MEM_GAP_IX_EXPAND_FACTOR;
+    gap_pt new_ix = NULL;
+    if(_mem_in_meta_block(pool_mgr, pool_mgr->gap_ix)) {
+        // an embedded gap index can't be realloc'd, so move it to the heap
+        new_ix = (gap_pt)malloc(new_capacity * sizeof(gap_t));
+        if(new_ix) memcpy(new_ix, pool_mgr->gap_ix, pool_mgr->gap_ix_capacity * sizeof(gap_t));
+    } else {
+        new_ix = (gap_pt)realloc(pool_mgr->gap_ix, new_capacity * sizeof(gap_t));
+    }
+    if(!new_ix) return ALLOC_FAIL;
+    memset(new_ix + pool_mgr->gap_ix_capacity, 0,
+           (new_capacity - pool_mgr->gap_ix_capacity) * sizeof(gap_t));
+
+    // don't forget to update capacity variables
+    pool_mgr->gap_ix = new_ix;
+    pool_mgr->gap_ix_capacity = new_capacity;
+    MEM_COUNT(pool_mgr, gap_ix_growths, 1);
+    MEM_PROBE2(gap_ix_grow, pool_mgr, new_capacity);
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_shrink_node_heap(pool_mgr_pt pool_mgr) {
+    // check if necessary (the hysteresis keeps it from thrashing with growth)
+    // note: quick lists link nodes by index, so nodes on them can't move
+    if(pool_mgr->num_deferred
+       || pool_mgr->total_nodes <= MEM_NODE_HEAP_INIT_CAPACITY
+       || ((float) pool_mgr->used_nodes / pool_mgr->total_nodes)
+          >= MEM_NODE_HEAP_SHRINK_FACTOR) return ALLOC_OK;
+
+    unsigned new_total = pool_mgr->total_nodes / MEM_NODE_HEAP_EXPAND_FACTOR;
+    if(new_total < MEM_NODE_HEAP_INIT_CAPACITY) new_total = MEM_NODE_HEAP_INIT_CAPACITY;
+    node_pt old_heap = pool_mgr->node_heap;
+    node_pt new_heap = (node_pt)calloc(new_total, sizeof(node_t));
+    if(!new_heap) return ALLOC_FAIL;
+
+    // compact the used nodes in list order, so the head stays at node_heap[0]
+    // note: old nodes keep a forwarding pointer to their copy in prev
+    node_pt current_node = old_heap;
+    unsigned i = 0;
+    while(current_node) {
+        node_pt next = current_node->next;
+        new_heap[i] = *current_node;
+        new_heap[i].prev = i ? &new_heap[i - 1] : NULL;
+        new_heap[i].next = next ? &new_heap[i + 1] : NULL;
+        current_node->prev = &new_heap[i];
+        current_node = next;
+        ++i;
+    }
+    assert(i == pool_mgr->used_nodes);
+    pool_mgr->tail = &new_heap[i - 1];
+    pool_mgr->free_nodes = NULL;
+    pool_mgr->node_hwm = i;
+    for(unsigned g = 0; !pool_mgr->gap_ix_dirty && g < pool_mgr->pool.num_gaps; ++g) {
+        pool_mgr->gap_ix[g].node = pool_mgr->gap_ix[g].node->prev;
+    }
+    _mem_free_meta(pool_mgr, old_heap);
+
+    // don't forget to update capacity variables
+    pool_mgr->node_heap = new_heap;
+    pool_mgr->total_nodes = new_total;
+
+    // the allocation index refers to nodes by position, so rebuild it
+    _mem_clear_alloc_ix(pool_mgr);
+    for(unsigned n = 0; n < pool_mgr->used_nodes; ++n) {
+        if(new_heap[n].allocated) _mem_add_to_alloc_ix(pool_mgr, &new_heap[n]);
+    }
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_shrink_gap_ix(pool_mgr_pt pool_mgr) {
+    // check if necessary (the hysteresis keeps it from thrashing with growth)
+    // note: a grown gap index is never in the meta block, so it can be realloc'd
+    if(pool_mgr->gap_ix_capacity <= MEM_GAP_IX_INIT_CAPACITY
+       || ((float) pool_mgr->pool.num_gaps / pool_mgr->gap_ix_capacity)
+          >= MEM_GAP_IX_SHRINK_FACTOR) return ALLOC_OK;
+
+    unsigned new_capacity = pool_mgr->gap_ix_capacity / MEM_GAP_IX_EXPAND_FACTOR;
+    if(new_capacity < MEM_GAP_IX_INIT_CAPACITY) new_capacity = MEM_GAP_IX_INIT_CAPACITY;
+    gap_pt new_ix = (gap_pt)realloc(pool_mgr->gap_ix, new_capacity * sizeof(gap_t));
+    if(!new_ix) return ALLOC_FAIL;
+
+    // don't forget to update capacity variables
+    pool_mgr->gap_ix = new_ix;
+    pool_mgr->gap_ix_capacity = new_capacity;
+
+    // the scratch buffer shrinks with it (the next rebuild allocates it again)
+    if(pool_mgr->gap_scratch_capacity > new_capacity) {
+        free(pool_mgr->gap_scratch);
+        pool_mgr->gap_scratch = NULL;
+        pool_mgr->gap_scratch_capacity = 0;
+    }
+
+    return ALLOC_OK;
 }
 
 static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
@@ -513,38 +1554,25 @@ static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
                                        node_pt node) {
 
     // expand the gap index, if necessary (call the function)
-    //----------LATER----------------//
+    alloc_status status = _mem_resize_gap_ix(pool_mgr);
+    if(status != ALLOC_OK) return ALLOC_FAIL;
 
     // add the entry at the end
     pool_mgr->gap_ix[pool_mgr->pool.num_gaps].size = size;
     pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = node;
 
-    // update metadata (num_gaps)
+    // update metadata (num_gaps, gap stats)
     pool_mgr->pool.num_gaps ++;
+    _mem_count_gap(pool_mgr, size);
 
     // sort the gap index (call the function)
-    alloc_status status = _mem_sort_gap_ix(pool_mgr);
+    status = _mem_sort_gap_ix(pool_mgr);
     assert(status == ALLOC_OK);
 
-    return status;
-
-    /*
-    // resize the gap index, if necessary
-    alloc_status result = _mem_resize_gap_ix(pool_mgr);
-    assert(result == ALLOC_OK);
-    if (result != ALLOC_OK) return ALLOC_FAIL;
-
-    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].size = size;
-    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = node;
-    pool_mgr->pool.num_gaps ++;
-
-    // sort the gap index after addition
-    result = _mem_sort_gap_ix(pool_mgr);
-    assert(result == ALLOC_OK);
-    if (result != ALLOC_OK) return ALLOC_FAIL;
-
+    // the index is sorted by size, so the largest gap is the last one
+    pool_mgr->pool.largest_gap = pool_mgr->gap_ix[pool_mgr->pool.num_gaps - 1].size;
 
-    return result;*/
+    return status;
 }
 
 static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
@@ -560,6 +1588,7 @@ static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
         }
     }
     if(position < 0) return ALLOC_FAIL;
+    _mem_uncount_gap(pool_mgr, gap_ix[position].size);
 
     // loop from there to the end of the array:
     for(int i = position; i < pool_mgr->pool.num_gaps - 1; ++i){
@@ -575,6 +1604,10 @@ static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
     gap_ix[pool_mgr->pool.num_gaps].size = 0;
     gap_ix[pool_mgr->pool.num_gaps].node = NULL;
 
+    // the index is sorted by size, so the largest gap is the last one
+    pool_mgr->pool.largest_gap = pool_mgr->pool.num_gaps
+                                 ? gap_ix[pool_mgr->pool.num_gaps - 1].size : 0;
+
     return ALLOC_OK;
 }
 
@@ -602,7 +1635,2515 @@ static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr) {
     return ALLOC_OK;
 }
 
-static alloc_status _mem_invalidate_gap_ix(pool_mgr_pt pool_mgr) {
-    return ALLOC_FAIL;
+static void _mem_invalidate_gap_ix(pool_mgr_pt pool_mgr) {
+    // the entries are left as they are, until _mem_rebuild_gap_ix
+    // note: the caller keeps num_gaps and largest_gap up to date meanwhile
+    pool_mgr->gap_ix_dirty = 1;
+}
+
+static alloc_status _mem_rebuild_gap_ix(pool_mgr_pt pool_mgr) {
+    // check if necessary
+    if(!pool_mgr->gap_ix_dirty) return ALLOC_OK;
+
+    // make room for all the gaps, as if they were added one at a time
+    // note: num_gaps is up to date, so the resize sees how many there are
+    unsigned num_gaps = pool_mgr->pool.num_gaps;
+    while(((float) num_gaps / pool_mgr->gap_ix_capacity) > MEM_GAP_IX_FILL_FACTOR) {
+        if(_mem_resize_gap_ix(pool_mgr) != ALLOC_OK) return ALLOC_FAIL;
+    }
+    // the sort's buffer is kept as large as the index, so that rebuilds
+    // don't allocate once it has grown (the old contents aren't needed)
+    if(num_gaps > 1 && pool_mgr->gap_scratch_capacity < pool_mgr->gap_ix_capacity) {
+        free(pool_mgr->gap_scratch);
+        pool_mgr->gap_scratch_capacity = 0;
+        pool_mgr->gap_scratch = (gap_pt)malloc(pool_mgr->gap_ix_capacity * sizeof(gap_t));
+        if(!pool_mgr->gap_scratch) return ALLOC_FAIL;
+        pool_mgr->gap_scratch_capacity = pool_mgr->gap_ix_capacity;
+    }
+
+    // collect the gaps in one pass over the node heap, so they come in node
+    // address order, which breaks ties in size
+    unsigned g = 0;
+    for(unsigned i = 0; i < pool_mgr->node_hwm; ++i) {
+        node_pt node = &pool_mgr->node_heap[i];
+        if(!node->used || node->allocated || node->deferred) continue;
+        pool_mgr->gap_ix[g].size = node->alloc_record.size;
+        pool_mgr->gap_ix[g].node = node;
+        ++g;
+    }
+    assert(g == num_gaps);
+
+    // then sort them by size, keeping that order among equal sizes
+    if(num_gaps > 1) _mem_radix_sort_gaps(pool_mgr->gap_ix, pool_mgr->gap_scratch, num_gaps);
+    pool_mgr->gap_ix_dirty = 0;
+    assert(num_gaps == 0 || pool_mgr->pool.largest_gap == pool_mgr->gap_ix[num_gaps - 1].size);
+
+    return ALLOC_OK;
+}
+
+static void _mem_radix_sort_gaps(gap_pt gaps, gap_pt temp, unsigned num_gaps) {
+    // LSD radix sort on the size, a byte at a time, which is stable
+    // note: bytes above the largest size are all zero, so those passes are skipped
+    size_t max_size = 0;
+    for(unsigned i = 0; i < num_gaps; ++i) {
+        if(gaps[i].size > max_size) max_size = gaps[i].size;
+    }
+    gap_pt from = gaps, to = temp;
+    for(unsigned shift = 0; shift < 8 * sizeof(size_t) && (max_size >> shift); shift += 8) {
+        unsigned counts[256] = {0};
+        for(unsigned i = 0; i < num_gaps; ++i) counts[(from[i].size >> shift) & 0xff] ++;
+        // a pass with a single digit changes nothing
+        if(counts[(from[0].size >> shift) & 0xff] == num_gaps) continue;
+        unsigned offset = 0;
+        for(unsigned d = 0; d < 256; ++d) {
+            unsigned count = counts[d];
+            counts[d] = offset;
+            offset += count;
+        }
+        for(unsigned i = 0; i < num_gaps; ++i) to[counts[(from[i].size >> shift) & 0xff] ++] = from[i];
+        gap_pt swap = from;
+        from = to;
+        to = swap;
+    }
+    if(from != gaps) memcpy(gaps, from, num_gaps * sizeof(gap_t));
+}
+
+static void _mem_coalesce_deferred(pool_mgr_pt pool_mgr) {
+    // coalesce the runs of free nodes in one pass over the list
+    // (never across the start of an extent), deferred or not
+    unsigned num_gaps = 0;
+    size_t largest_gap = 0;
+    _mem_reset_gap_stats(pool_mgr);
+    node_pt node = pool_mgr->node_heap;
+    while(node) {
+        node->deferred = 0;
+        node_pt next = node->next;
+        while(!node->allocated && next && !next->allocated && !next->boundary) {
+            node_pt after = next->next;
+            node->alloc_record.size += next->alloc_record.size;
+            node->purged = node->purged && next->purged;
+            MEM_COUNT(pool_mgr, coalesces, 1);
+            MEM_PROBE3(coalesce, pool_mgr, node->alloc_record.mem, node->alloc_record.size);
+            //   unlink the merged node and update metadata (used_nodes)
+            node->next = after;
+            if(after) after->prev = node;
+            else pool_mgr->tail = node;
+            next->used = 0;
+            next->deferred = 0;
+            _mem_put_unused_node(pool_mgr, next);
+            pool_mgr->used_nodes --;
+            next = after;
+        }
+        if(!node->allocated) {
+            num_gaps ++;
+            _mem_count_gap(pool_mgr, node->alloc_record.size);
+            if(node->alloc_record.size > largest_gap) largest_gap = node->alloc_record.size;
+        }
+        node = next;
+    }
+    // the lists are empty now, and those that weren't used since the last
+    // flush hold on to fewer nodes from here on
+    if(pool_mgr->quick_lists) {
+        quick_list_t kept[MEM_QUICK_LISTS];
+        unsigned num_kept = 0;
+        for(unsigned i = 0; i < MEM_QUICK_LISTS; ++i) {
+            quick_list_t list = pool_mgr->quick_lists[i];
+            if(!list.cap) continue;
+            if(!list.hits) list.cap /= MEM_QUICK_LIST_EXPAND_FACTOR;
+            if(list.cap) kept[num_kept ++] = list;
+        }
+        _mem_reset_quick_lists(pool_mgr);
+        for(unsigned i = 0; i < num_kept; ++i) {
+            quick_list_pt list = _mem_find_quick_list(pool_mgr, kept[i].size, 1);
+            list->cap = kept[i].cap;
+        }
+    }
+    pool_mgr->num_deferred = 0;
+
+    // the gaps changed wholesale, so the index is rebuilt when next needed
+    pool_mgr->pool.num_gaps = num_gaps;
+    pool_mgr->pool.largest_gap = largest_gap;
+    _mem_invalidate_gap_ix(pool_mgr);
+}
+
+static void _mem_count_gap(pool_mgr_pt pool_mgr, size_t size) {
+    pool_mgr->gap_size += size;
+    pool_mgr->gap_histogram[_mem_gap_bucket(size)] ++;
+}
+
+static void _mem_uncount_gap(pool_mgr_pt pool_mgr, size_t size) {
+    assert(pool_mgr->gap_size >= size);
+    assert(pool_mgr->gap_histogram[_mem_gap_bucket(size)] > 0);
+    pool_mgr->gap_size -= size;
+    pool_mgr->gap_histogram[_mem_gap_bucket(size)] --;
+}
+
+static void _mem_reset_gap_stats(pool_mgr_pt pool_mgr) {
+    pool_mgr->gap_size = 0;
+    memset(pool_mgr->gap_histogram, 0, sizeof(pool_mgr->gap_histogram));
+}
+
+static unsigned _mem_gap_bucket(size_t size) {
+    // floor(log2(size)), with empty gaps in the first bucket
+    return size ? (unsigned) (63 - __builtin_clzll((unsigned long long) size)) : 0;
 }
 
+static alloc_status _mem_defer_node(pool_mgr_pt pool_mgr, node_pt node) {
+    // push the node on the quick list for its size, if there is room
+    // (deferred coalescing takes every free, whatever the caps)
+    // note: links are node indices, as the node heap may move
+    quick_list_pt list = _mem_find_quick_list(pool_mgr, node->alloc_record.size, 1);
+    if(!list || (!pool_mgr->max_deferred && list->count >= list->cap)) return ALLOC_FAIL;
+    node->deferred = 1;
+    node->quick_next = list->head;
+    list->head = (unsigned) (node - pool_mgr->node_heap) + 1;
+    list->count ++;
+    pool_mgr->num_deferred ++;
+
+    return ALLOC_OK;
+}
+
+static node_pt _mem_take_deferred(pool_mgr_pt pool_mgr, size_t size) {
+    // pop a node of exactly this size off its quick list
+    quick_list_pt list = _mem_find_quick_list(pool_mgr, size, 0);
+    if(!list) return NULL;
+    if(!list->head) {
+        // a hot size ran out, so let its list hold more
+        if(pool_mgr->quick_list_max) {
+            list->cap *= MEM_QUICK_LIST_EXPAND_FACTOR;
+            if(list->cap > pool_mgr->quick_list_max) list->cap = pool_mgr->quick_list_max;
+        }
+        return NULL;
+    }
+    node_pt node = &pool_mgr->node_heap[list->head - 1];
+    list->head = node->quick_next;
+    list->count --;
+    list->hits ++;
+    node->deferred = 0;
+    pool_mgr->num_deferred --;
+
+    return node;
+}
+
+static quick_list_pt _mem_find_quick_list(pool_mgr_pt pool_mgr, size_t size, int create) {
+    // Fibonacci hashing of the size, the number of lists is a power of two,
+    // then linear probing up to the first unused slot
+    // returns null, if not found (and not created, or no slot is left)
+    unsigned long long hash = (unsigned long long) size * 11400714819323198485ull;
+    unsigned slot = (unsigned) (hash >> 32) & (MEM_QUICK_LISTS - 1);
+    for(unsigned i = 0; i < MEM_QUICK_LISTS; ++i) {
+        quick_list_pt list = &pool_mgr->quick_lists[(slot + i) & (MEM_QUICK_LISTS - 1)];
+        if(list->cap && list->size == size) return list;
+        if(!list->cap) {
+            if(!create) return NULL;
+            list->size = size;
+            list->cap = MEM_QUICK_LIST_INIT_CAP;
+            if(pool_mgr->quick_list_max && list->cap > pool_mgr->quick_list_max) {
+                list->cap = pool_mgr->quick_list_max;
+            }
+            return list;
+        }
+    }
+
+    return NULL;
+}
+
+static void _mem_reset_quick_lists(pool_mgr_pt pool_mgr) {
+    // forget all lists, with their nodes
+    // note: the caller takes care of the nodes
+    if(pool_mgr->quick_lists) memset(pool_mgr->quick_lists, 0, MEM_QUICK_LISTS * sizeof(quick_list_t));
+    pool_mgr->num_deferred = 0;
+}
+
+static alloc_status _mem_resize_alloc_ix(pool_mgr_pt pool_mgr) {
+    // check if necessary (room for one more allocation)
+    if(pool_mgr->alloc_ix
+       && ((float) (pool_mgr->pool.num_allocs + 1) / pool_mgr->alloc_ix_capacity)
+          <= MEM_ALLOC_IX_FILL_FACTOR) return ALLOC_OK;
+
+    unsigned new_capacity = pool_mgr->alloc_ix
+                            ? pool_mgr->alloc_ix_capacity * MEM_ALLOC_IX_EXPAND_FACTOR
+                            : MEM_ALLOC_IX_INIT_CAPACITY;
+    alloc_ix_entry_pt new_ix = (alloc_ix_entry_pt)calloc(new_capacity, sizeof(alloc_ix_entry_t));
+    if(!new_ix) return ALLOC_FAIL;
+
+    // the slots depend on the capacity, so re-insert the live entries
+    alloc_ix_entry_pt old_ix = pool_mgr->alloc_ix;
+    unsigned old_capacity = pool_mgr->alloc_ix_capacity;
+    unsigned old_epoch = pool_mgr->alloc_ix_epoch;
+    pool_mgr->alloc_ix = new_ix;
+    pool_mgr->alloc_ix_capacity = new_capacity;
+    pool_mgr->alloc_ix_epoch = 1;
+    for(unsigned i = 0; i < old_capacity; ++i) {
+        if(old_ix[i].epoch == old_epoch) {
+            _mem_add_to_alloc_ix(pool_mgr, &pool_mgr->node_heap[old_ix[i].node]);
+        }
+    }
+    free(old_ix);
+
+    return ALLOC_OK;
+}
+
+static void _mem_add_to_alloc_ix(pool_mgr_pt pool_mgr, node_pt node) {
+    // note: the caller expands the index beforehand, so there is an empty slot
+    unsigned mask = pool_mgr->alloc_ix_capacity - 1;
+    unsigned slot = _mem_hash_alloc(pool_mgr, node->alloc_record.mem);
+    while(pool_mgr->alloc_ix[slot].epoch == pool_mgr->alloc_ix_epoch) {
+        slot = (slot + 1) & mask;
+    }
+    pool_mgr->alloc_ix[slot].node = (unsigned) (node - pool_mgr->node_heap);
+    pool_mgr->alloc_ix[slot].epoch = pool_mgr->alloc_ix_epoch;
+}
+
+static unsigned _mem_find_in_alloc_ix(pool_mgr_pt pool_mgr, const char *mem) {
+    // returns alloc_ix_capacity if not found
+    if(!pool_mgr->alloc_ix) return pool_mgr->alloc_ix_capacity;
+
+    unsigned mask = pool_mgr->alloc_ix_capacity - 1;
+    unsigned slot = _mem_hash_alloc(pool_mgr, mem);
+    while(pool_mgr->alloc_ix[slot].epoch == pool_mgr->alloc_ix_epoch) {
+        if(pool_mgr->node_heap[pool_mgr->alloc_ix[slot].node].alloc_record.mem == mem) {
+            return slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return pool_mgr->alloc_ix_capacity;
+}
+
+static void _mem_remove_from_alloc_ix(pool_mgr_pt pool_mgr, unsigned slot) {
+    // pull later entries of the probe run back into the hole, so that
+    // lookups never stop early (no tombstones needed)
+    alloc_ix_entry_pt alloc_ix = pool_mgr->alloc_ix;
+    unsigned mask = pool_mgr->alloc_ix_capacity - 1;
+    unsigned next = slot;
+    for(;;) {
+        next = (next + 1) & mask;
+        if(alloc_ix[next].epoch != pool_mgr->alloc_ix_epoch) break;
+        unsigned home = _mem_hash_alloc(pool_mgr,
+                                        pool_mgr->node_heap[alloc_ix[next].node].alloc_record.mem);
+        // the entry stays if its home slot is cyclically in (slot, next]
+        if(slot <= next ? (slot < home && home <= next) : (slot < home || home <= next)) {
+            continue;
+        }
+        alloc_ix[slot] = alloc_ix[next];
+        slot = next;
+    }
+    alloc_ix[slot].epoch = 0;
+}
+
+static void _mem_clear_alloc_ix(pool_mgr_pt pool_mgr) {
+    // entries of an older epoch count as empty, so this is O(1)
+    // (except when the epoch wraps around and the slots are zeroed)
+    if(++ pool_mgr->alloc_ix_epoch == 0) {
+        if(pool_mgr->alloc_ix) {
+            memset(pool_mgr->alloc_ix, 0, pool_mgr->alloc_ix_capacity * sizeof(alloc_ix_entry_t));
+        }
+        pool_mgr->alloc_ix_epoch = 1;
+    }
+}
+
+static unsigned _mem_hash_alloc(pool_mgr_pt pool_mgr, const char *mem) {
+    // Fibonacci hashing of the address, the capacity is a power of two
+    unsigned long long hash = (unsigned long long) (size_t) mem * 11400714819323198485ull;
+
+    return (unsigned) (hash >> 32) & (pool_mgr->alloc_ix_capacity - 1);
+}
+
+static pool_mgr_pt _mem_new_pool_mgr(char *mem, size_t size, alloc_policy policy) {
+    // allocate a new mem pool mgr
+    pool_mgr_pt new_mgr = (pool_mgr_pt)calloc(1, sizeof(pool_mgr_t));
+    // check success, on error return null
+    if(!new_mgr) return NULL;
+
+    // allocate a new node heap
+    node_pt new_heap = (node_pt)calloc(MEM_NODE_HEAP_INIT_CAPACITY, sizeof(node_t));
+    // check success, on error deallocate mgr and return null
+    if(!new_heap) {
+        free(new_mgr);
+        return NULL;
+    }
+
+    // allocate a new gap index
+    gap_pt new_gap = (gap_pt)calloc(MEM_GAP_IX_INIT_CAPACITY, sizeof(gap_t));
+    // check success, on error deallocate mgr/heap and return null
+    if(!new_gap) {
+        free(new_heap);
+        free(new_mgr);
+        return NULL;
+    }
+    // assign all the pointers and update meta data
+    _mem_init_pool_mgr(new_mgr, new_heap, new_gap, mem, size, policy);
+
+    return new_mgr;
+}
+
+static pool_mgr_pt _mem_carve_pool_mgr(char *block, size_t block_size, alloc_policy policy) {
+    // lay out [mgr | node heap | gap index | pool memory] in the block,
+    // each starting on a cache line, so the mgr doesn't share one with the pool
+    size_t heap_offset = _mem_cache_line_round(sizeof(pool_mgr_t));
+    size_t gap_offset = _mem_cache_line_round(heap_offset
+                                              + MEM_NODE_HEAP_INIT_CAPACITY * sizeof(node_t));
+    size_t mem_offset = _mem_meta_size();
+    // check there is room left for the pool, on error return null
+    if(block_size <= mem_offset) return NULL;
+
+    // the metadata is expected to start zeroed, as if calloc'd
+    memset(block, 0, mem_offset);
+    pool_mgr_pt new_mgr = (pool_mgr_pt)block;
+    _mem_init_pool_mgr(new_mgr,
+                       (node_pt)(block + heap_offset),
+                       (gap_pt)(block + gap_offset),
+                       block + mem_offset,
+                       block_size - mem_offset,
+                       policy);
+    new_mgr->meta_block = block;
+    new_mgr->meta_block_size = block_size;
+
+    return new_mgr;
+}
+
+static pool_mgr_pt _mem_carve_tagged_pool_mgr(char *block, size_t block_size, alloc_policy policy) {
+    // lay out [mgr | pool memory] in the block, the pool starting on a cache
+    // line; the blocks in it are tagged, so there are no nodes or gap entries
+    size_t mem_offset = _mem_cache_line_round(sizeof(pool_mgr_t));
+    if(block_size <= mem_offset) return NULL;
+
+    memset(block, 0, mem_offset);
+    pool_mgr_pt new_mgr = (pool_mgr_pt)block;
+    _mem_init_pool_mgr(new_mgr, NULL, NULL, block + mem_offset, block_size - mem_offset, policy);
+    new_mgr->meta_block = block;
+    new_mgr->meta_block_size = block_size;
+    new_mgr->tagged = 1;
+    _mem_tag_write(new_mgr->pool.mem, new_mgr->pool.total_size, 0);
+
+    return new_mgr;
+}
+
+static void _mem_init_pool_mgr(pool_mgr_pt pool_mgr,
+                               node_pt node_heap,
+                               gap_pt gap_ix,
+                               char *mem,
+                               size_t size,
+                               alloc_policy policy) {
+    // note: a tagged pool has neither (both NULL)
+    if(node_heap) {
+        //   initialize top node of node heap
+        node_heap[0].alloc_record.mem = mem;
+        node_heap[0].alloc_record.size = size;
+        node_heap[0].used = 1;
+        node_heap[0].allocated = 0;
+        node_heap[0].boundary = 1;
+        node_heap[0].purged = 0;
+        node_heap[0].deferred = 0;
+        node_heap[0].prev = NULL;
+        node_heap[0].next = NULL;
+
+        //   initialize top node of gap index
+        gap_ix[0].size = size;  // Total pool size //
+        gap_ix[0].node = node_heap;  // First node in node heap //
+    }
+
+    //   initialize pool mgr
+    pool_mgr->pool.mem = mem;
+    pool_mgr->pool.policy = policy;
+    pool_mgr->pool.total_size = size;
+    pool_mgr->pool.alloc_size = 0;
+    pool_mgr->pool.num_allocs = 0;
+    pool_mgr->pool.num_gaps = 1;
+    pool_mgr->pool.largest_gap = size;
+    pool_mgr->node_heap = node_heap;
+    pool_mgr->total_nodes = node_heap ? MEM_NODE_HEAP_INIT_CAPACITY : 0;
+    pool_mgr->used_nodes = node_heap ? 1 : 0;
+    pool_mgr->tail = node_heap;
+    pool_mgr->free_nodes = NULL;
+    pool_mgr->node_hwm = node_heap ? 1 : 0;
+    pool_mgr->gap_ix = gap_ix;
+    pool_mgr->gap_ix_capacity = gap_ix ? MEM_GAP_IX_INIT_CAPACITY : 0;
+    pool_mgr->gap_ix_dirty = 0;
+    pool_mgr->gap_scratch = NULL;
+    pool_mgr->gap_scratch_capacity = 0;
+    pool_mgr->consecutive_frees = 0;
+    pool_mgr->alloc_ix = NULL;
+    pool_mgr->alloc_ix_capacity = 0;
+    pool_mgr->alloc_ix_epoch = 1;
+    pool_mgr->reserved_size = 0;
+    pool_mgr->expandable = 0;
+    pool_mgr->extents = NULL;
+    pool_mgr->num_extents = 1;
+    pool_mgr->extents_capacity = 0;
+    pool_mgr->purge_threshold = 0;
+    pool_mgr->max_deferred = 0;
+    pool_mgr->num_deferred = 0;
+    pool_mgr->quick_list_max = 0;
+    pool_mgr->quick_lists = NULL;
+    pool_mgr->caller_mem = 0;
+    pool_mgr->meta_block = NULL;
+    pool_mgr->meta_block_size = 0;
+    pool_mgr->meta_block_owned = 0;
+    pool_mgr->arena_top = 0;
+    pool_mgr->arena_last = (size_t) -1;
+    pool_mgr->arena_epoch = 0;
+    pool_mgr->num_arena_floors = 0;
+    pool_mgr->tagged = 0;
+    pool_mgr->granule = 0;
+    pool_mgr->num_granules = 0;
+    pool_mgr->bitmap_words = 0;
+    pool_mgr->bitmap = NULL;
+    pool_mgr->bitmap_starts = NULL;
+    pool_mgr->bitmap_summary = NULL;
+    pool_mgr->generation = 0;
+    atomic_init(&pool_mgr->stats_seq, 0);
+#ifdef MEM_POOL_COUNTERS
+    memset(&pool_mgr->counters, 0, sizeof(pool_mgr->counters));
+#endif
+#ifdef MEM_POOL_LATENCY
+    memset(pool_mgr->latency, 0, sizeof(pool_mgr->latency));
+#endif
+#ifdef MEM_POOL_LAYOUT
+    pool_mgr->layout_out = NULL;
+    pool_mgr->layout_every = 0;
+#endif
+    _mem_reset_gap_stats(pool_mgr);
+    _mem_count_gap(pool_mgr, size);
+}
+
+static void _mem_free_pool_mgr(pool_mgr_pt pool_mgr) {
+    // note: the pool memory is released by the caller, unless in the meta block
+    char *block = pool_mgr->meta_block_owned ? pool_mgr->meta_block : NULL;
+    _mem_free_meta(pool_mgr, pool_mgr->node_heap);
+    _mem_free_meta(pool_mgr, pool_mgr->gap_ix);
+    free(pool_mgr->gap_scratch);
+    free(pool_mgr->alloc_ix);
+    free(pool_mgr->quick_lists);
+    free(pool_mgr->bitmap); // note: the other maps are in the same block
+    _mem_free_meta(pool_mgr, pool_mgr);
+    free(block);
+}
+
+static void _mem_free_meta(pool_mgr_pt pool_mgr, void *meta) {
+    // whatever was carved from the meta block isn't freed on its own
+    if(!_mem_in_meta_block(pool_mgr, meta)) free(meta);
+}
+
+static int _mem_in_meta_block(pool_mgr_pt pool_mgr, void *meta) {
+    return pool_mgr->meta_block
+           && (char*)meta >= pool_mgr->meta_block
+           && (char*)meta < pool_mgr->meta_block + pool_mgr->meta_block_size;
+}
+
+static size_t _mem_meta_size() {
+    // the mgr, the initial node heap and gap index, each cache-line aligned
+    return _mem_cache_line_round(sizeof(pool_mgr_t))
+           + _mem_cache_line_round(MEM_NODE_HEAP_INIT_CAPACITY * sizeof(node_t))
+           + _mem_cache_line_round(MEM_GAP_IX_INIT_CAPACITY * sizeof(gap_t));
+}
+
+static size_t _mem_cache_line_round(size_t size) {
+    return (size + MEM_CACHE_LINE_SIZE - 1) / MEM_CACHE_LINE_SIZE * MEM_CACHE_LINE_SIZE;
+}
+
+static alloc_status _mem_add_to_pool_store(pool_mgr_pt pool_mgr) {
+    // note: the reporter may be reading the store
+    pthread_mutex_lock(&pool_store_lock);
+    // expand the pool store, if necessary
+    alloc_status status = _mem_resize_pool_store();
+    if(status == ALLOC_OK) {
+        //   link pool mgr to pool store
+        pool_store[pool_store_size] = pool_mgr;
+        pool_store_size ++;
+    }
+    pthread_mutex_unlock(&pool_store_lock);
+
+    return status;
+}
+
+static void * _mem_new_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    // saved walk positions don't survive a change
+    pool_mgr->generation ++;
+    // arenas just bump a pointer
+    if(pool_mgr->pool.policy == ARENA) return _mem_arena_alloc(pool_mgr, size);
+    // tagged pools find their blocks in the pool memory itself
+    if(pool_mgr->tagged) return _mem_tagged_alloc(pool_mgr, size);
+    // bitmaps search for a run of free granules
+    if(pool_mgr->pool.policy == BITMAP) return _mem_bitmap_alloc(pool_mgr, size);
+    // check if any gap is large enough, return null if none (unless the pool can grow)
+    // note: deferred frees aren't gaps yet, but may be reused or coalesced
+    if((pool_mgr->pool.num_gaps == 0 || size > pool_mgr->pool.largest_gap)
+       && !pool_mgr->reserved_size && !pool_mgr->expandable && !pool_mgr->num_deferred) return NULL;
+
+    // expand heap node, if necessary, quit on error
+    // note: this moves the nodes, so do it before holding any node pointers
+    alloc_status status = _mem_resize_node_heap(pool_mgr);
+    if(status != ALLOC_OK) return NULL;
+    // check used nodes fewer than total nodes, quit on error
+    if(pool_mgr->used_nodes >= pool_mgr->total_nodes) return NULL;
+    // expand the allocation index, if necessary, quit on error
+    status = _mem_resize_alloc_ix(pool_mgr);
+    if(status != ALLOC_OK) return NULL;
+    // bring the gap index up to date, if frees left it stale
+    pool_mgr->consecutive_frees = 0;
+    if(_mem_rebuild_gap_ix(pool_mgr) != ALLOC_OK) return NULL;
+
+    // reuse a deferred free of the same size as it is, if there is one
+    if(pool_mgr->quick_lists) {
+        node_pt alloc_node = _mem_take_deferred(pool_mgr, size);
+        if(alloc_node) {
+            alloc_node->allocated = 1;
+            _mem_add_to_alloc_ix(pool_mgr, alloc_node);
+            pool_mgr->pool.num_allocs ++;
+            pool_mgr->pool.alloc_size += size;
+            return alloc_node->alloc_record.mem;
+        }
+    }
+
+    // get a node for allocation according to the pool policy
+    // note: a pool that can grow skips the search if no gap is large enough
+    node_pt gap_node = (size <= pool_mgr->pool.largest_gap) ? _mem_find_gap(pool_mgr, size) : NULL;
+    // on a miss, coalesce the deferred frees and search again
+    if(!gap_node && pool_mgr->num_deferred) {
+        _mem_coalesce_deferred(pool_mgr);
+        if(_mem_rebuild_gap_ix(pool_mgr) != ALLOC_OK) return NULL;
+        if(size <= pool_mgr->pool.largest_gap) gap_node = _mem_find_gap(pool_mgr, size);
+    }
+    // if none is large enough, try to grow the pool and search again
+    if(!gap_node && _mem_expand_pool(pool_mgr, size) == ALLOC_OK) {
+        gap_node = _mem_find_gap(pool_mgr, size);
+    }
+    // check if node found
+    if(!gap_node) return NULL;  // No gap node found //
+
+    // update metadata (num_allocs, alloc_size)
+    pool_mgr->pool.num_allocs ++;
+    pool_mgr->pool.alloc_size += size;
+
+    // calculate the size of the remaining gap, if any
+    size_t remaining_gap = gap_node->alloc_record.size - size;
+
+    // remove node from gap index
+    status = _mem_remove_from_gap_ix(pool_mgr, gap_node->alloc_record.size, gap_node);
+    assert(status == ALLOC_OK);
+
+    // convert gap_node to an allocation node of given size
+    // note: the remainder, if any, takes over the purged flag below
+    unsigned purged = gap_node->purged;
+    gap_node->allocated = 1;
+    gap_node->alloc_record.size = size;
+    gap_node->purged = 0;
+    _mem_add_to_alloc_ix(pool_mgr, gap_node);
+
+    // adjust node heap:
+    //   if remaining gap, need a new node
+    if(remaining_gap > 0){
+        MEM_COUNT(pool_mgr, splits, 1);
+        MEM_PROBE4(split, pool_mgr, gap_node->alloc_record.mem, size, remaining_gap);
+        //   find an unused one in the node heap
+        node_pt new_gap_node = _mem_get_unused_node(pool_mgr);
+        //   make sure one was found
+        if(!new_gap_node) return NULL;
+
+        //   initialize it to a gap node
+        new_gap_node->used = 1;
+        new_gap_node->allocated = 0;
+        new_gap_node->boundary = 0;
+        new_gap_node->deferred = 0;
+        // the remainder's whole pages are a subset of the gap's
+        new_gap_node->purged = purged;
+        new_gap_node->alloc_record.mem = gap_node->alloc_record.mem + size;
+        new_gap_node->alloc_record.size = remaining_gap;
+
+        //   update metadata (used_nodes)
+        pool_mgr->used_nodes += 1;
+
+        //   update linked list (new node right after the node for allocation)
+        new_gap_node->next = gap_node->next;
+        if(gap_node->next) gap_node->next->prev = new_gap_node;
+        else pool_mgr->tail = new_gap_node;
+        new_gap_node->prev = gap_node;
+        gap_node->next = new_gap_node;
+
+        //   add to gap index (expanding it, if necessary)
+        status = _mem_add_to_gap_ix(pool_mgr, remaining_gap, new_gap_node);
+        //   check if successful
+        assert(status == ALLOC_OK);
+    }
+
+    // return allocation record by casting the node to (alloc_pt)
+    return gap_node->alloc_record.mem;
+}
+
+static alloc_status _mem_del_alloc(pool_mgr_pt pool_mgr, void *alloc) {
+    // saved walk positions don't survive a change
+    pool_mgr->generation ++;
+
+    // arenas can only take back their most recent allocation
+    if(pool_mgr->pool.policy == ARENA) {
+        if(pool_mgr->pool.num_allocs == 0 || (char*)alloc != pool_mgr->pool.mem + pool_mgr->arena_last) {
+            return ALLOC_FAIL;
+        }
+        pool_mgr->pool.num_allocs --;
+        pool_mgr->pool.alloc_size -= pool_mgr->arena_top - pool_mgr->arena_last;
+        pool_mgr->arena_top = pool_mgr->arena_last;
+        _mem_arena_lower(pool_mgr, pool_mgr->arena_top);
+        pool_mgr->pool.num_gaps = 1;
+        pool_mgr->pool.largest_gap = pool_mgr->pool.total_size - pool_mgr->arena_top;
+        // note: the allocation before it is unknown, so it can't be popped too
+        pool_mgr->arena_last = (size_t) -1;
+        return ALLOC_OK;
+    }
+    // tagged pools find the block right before the allocation
+    if(pool_mgr->tagged) return _mem_tagged_free(pool_mgr, alloc);
+    // bitmaps just clear the allocation's bits
+    if(pool_mgr->pool.policy == BITMAP) return _mem_bitmap_free(pool_mgr, alloc);
+
+    // find the node in the allocation index
+    unsigned slot = _mem_find_in_alloc_ix(pool_mgr, alloc);
+    // make sure it's found
+    if(slot == pool_mgr->alloc_ix_capacity) return ALLOC_FAIL;
+    node_pt delete_node = &pool_mgr->node_heap[pool_mgr->alloc_ix[slot].node];
+    _mem_remove_from_alloc_ix(pool_mgr, slot);
+
+    // convert to gap node
+    delete_node->allocated = 0;
+
+    // update metadata (num_allocs, alloc_size)
+    pool_mgr->pool.num_allocs --;
+    pool_mgr->pool.alloc_size -= delete_node->alloc_record.size;
+
+    // a deferred free only goes on the quick list for its size, until the
+    // deferred frees are coalesced all at once
+    if((pool_mgr->max_deferred || pool_mgr->quick_list_max)
+       && _mem_defer_node(pool_mgr, delete_node) == ALLOC_OK) {
+        if(pool_mgr->max_deferred && pool_mgr->num_deferred >= pool_mgr->max_deferred) {
+            _mem_coalesce_deferred(pool_mgr);
+        }
+        return ALLOC_OK;
+    }
+
+    // in a run of frees, e.g. at teardown, the gap index is left stale and
+    // rebuilt all at once when next needed, instead of updated on each free
+    // note: num_gaps and largest_gap are still kept up to date
+    if(!pool_mgr->gap_ix_dirty && ++pool_mgr->consecutive_frees >= MEM_GAP_IX_LAZY_FREES) {
+        _mem_invalidate_gap_ix(pool_mgr);
+    }
+    int lazy = pool_mgr->gap_ix_dirty;
+    unsigned merged = 0;
+
+    alloc_status status = lazy ? ALLOC_OK : ALLOC_FAIL;
+
+    // if the next node in the list is also a gap, merge into node-to-delete
+    // (unless it starts another extent)
+    // note: deferred nodes are on quick lists, not gaps
+    if(delete_node->next && delete_node->next->used ==  1 && delete_node->next->allocated == 0
+       && !delete_node->next->boundary && !delete_node->next->deferred) {
+        //   remove the next node from gap index
+        if(!lazy) {
+            status = _mem_remove_from_gap_ix(pool_mgr,delete_node->next->alloc_record.size,
+                                             delete_node->next);
+            //   check success
+            assert(status == ALLOC_OK);
+        } else {
+            _mem_uncount_gap(pool_mgr, delete_node->next->alloc_record.size);
+        }
+        merged ++;
+        MEM_COUNT(pool_mgr, coalesces, 1);
+        //   add the size to the node-to-delete
+        delete_node->alloc_record.size += delete_node->next->alloc_record.size;
+        MEM_PROBE3(coalesce, pool_mgr, delete_node->alloc_record.mem, delete_node->alloc_record.size);
+        //   update node as unused
+        delete_node->next->used = 0;
+        //   update metadata (used nodes)
+        pool_mgr->used_nodes --;
+
+        //   update linked list:
+        /*
+                        if (next->next) {
+                            next->next->prev = node_to_del;
+                            node_to_del->next = next->next;
+                        } else {
+                            node_to_del->next = NULL;
+                        }
+                        next->next = NULL;
+                        next->prev = NULL;
+         */
+        node_pt next = delete_node->next;
+        if(next->next) {  // Not end of list //
+            next->next->prev = delete_node;
+            delete_node->next = next->next;
+        } else {
+            delete_node->next = NULL;
+            pool_mgr->tail = delete_node;
+        }
+        _mem_put_unused_node(pool_mgr, next);
+    }
+
+    // this merged node-to-delete might need to be added to the gap index
+    // but one more thing to check...
+    // if the previous node in the list is also a gap, merge into previous!
+    // (unless node-to-delete starts an extent)
+    if(delete_node->prev && delete_node->prev->used ==  1 && delete_node->prev->allocated == 0
+       && !delete_node->boundary && !delete_node->prev->deferred) {
+        //   remove the previous node from gap index
+        if(!lazy) {
+            status = _mem_remove_from_gap_ix(pool_mgr, delete_node->prev->alloc_record.size,
+                                             delete_node->prev);
+            //   check success
+            assert(status == ALLOC_OK);
+        } else {
+            _mem_uncount_gap(pool_mgr, delete_node->prev->alloc_record.size);
+        }
+        merged ++;
+        MEM_COUNT(pool_mgr, coalesces, 1);
+        //   add the size of node-to-delete to the previous
+        delete_node->prev->alloc_record.size += delete_node->alloc_record.size;
+        MEM_PROBE3(coalesce, pool_mgr, delete_node->prev->alloc_record.mem,
+                   delete_node->prev->alloc_record.size);
+        //   the merged gap has pages that were never purged
+        delete_node->prev->purged = 0;
+        //   update node-to-delete as unused
+        delete_node->used = 0;
+        //   update metadata (used_nodes)
+        pool_mgr->used_nodes--;
+        //   update linked list
+        /*
+                        if (node_to_del->next) {
+                            prev->next = node_to_del->next;
+                            node_to_del->next->prev = prev;
+                        } else {
+                            prev->next = NULL;
+                        }
+                        node_to_del->next = NULL;
+                        node_to_del->prev = NULL;
+         */
+        node_pt prev = delete_node->prev;
+        if (delete_node->next) {
+            prev->next = delete_node->next;
+            delete_node->next->prev = prev;
+        } else {
+            prev->next = NULL;
+            pool_mgr->tail = prev;
+        }
+        _mem_put_unused_node(pool_mgr, delete_node);
+
+        //   change the node to add to the previous node!
+        delete_node = prev;
+    }
+
+    // add the resulting node to the gap index
+    if(!lazy) {
+        status = _mem_add_to_gap_ix(pool_mgr, delete_node->alloc_record.size, delete_node);
+        // check success
+        assert(status == ALLOC_OK);
+    } else {
+        pool_mgr->pool.num_gaps += 1 - merged;
+        _mem_count_gap(pool_mgr, delete_node->alloc_record.size);
+        if(delete_node->alloc_record.size > pool_mgr->pool.largest_gap) {
+            pool_mgr->pool.largest_gap = delete_node->alloc_record.size;
+        }
+    }
+
+    // an added extent that is entirely free is given back, unless the rest
+    // of the pool would be filled above the fill factor
+    if(delete_node->boundary && delete_node->alloc_record.mem != pool_mgr->pool.mem
+       && (!delete_node->next || delete_node->next->boundary)
+       && ((float) pool_mgr->pool.alloc_size
+           / (pool_mgr->pool.total_size - delete_node->alloc_record.size)
+           <= MEM_FILL_FACTOR)) {
+        // note: releasing it can shrink the largest gap, so it needs the index
+        status = _mem_rebuild_gap_ix(pool_mgr);
+        if(status == ALLOC_OK) status = _mem_release_extent(pool_mgr, delete_node);
+        assert(status == ALLOC_OK);
+    }
+
+    // return the pages of a large enough gap to the OS
+    if(pool_mgr->purge_threshold && delete_node->used
+       && delete_node->alloc_record.size >= pool_mgr->purge_threshold) {
+        status = _mem_purge_gap(pool_mgr, delete_node);
+    }
+
+    // shrink the metadata, if necessary
+    // note: this moves the nodes, so do it after releasing all node pointers
+    if(_mem_shrink_node_heap(pool_mgr) != ALLOC_OK
+       || _mem_shrink_gap_ix(pool_mgr) != ALLOC_OK) status = ALLOC_FAIL;
+
+    return status;
+}
+
+static alloc_status _mem_del_alloc_sized(pool_mgr_pt pool_mgr, void *alloc, size_t size) {
+    // knowing the size, an arena can pop any allocation that ends at the top
+    if(pool_mgr->pool.policy == ARENA) {
+        if(pool_mgr->pool.num_allocs == 0 || size > pool_mgr->arena_top
+           || (char*)alloc != pool_mgr->pool.mem + pool_mgr->arena_top - size) return ALLOC_FAIL;
+        // saved walk positions don't survive a change
+        pool_mgr->generation ++;
+        pool_mgr->pool.num_allocs --;
+        pool_mgr->pool.alloc_size -= size;
+        pool_mgr->arena_top -= size;
+        _mem_arena_lower(pool_mgr, pool_mgr->arena_top);
+        pool_mgr->pool.num_gaps = 1;
+        pool_mgr->pool.largest_gap = pool_mgr->pool.total_size - pool_mgr->arena_top;
+        if(pool_mgr->arena_last >= pool_mgr->arena_top) pool_mgr->arena_last = (size_t) -1;
+        return ALLOC_OK;
+    }
+
+#ifndef NDEBUG
+    // check the caller's size against the allocation record
+    if(pool_mgr->tagged) {
+        char *block = _mem_tagged_block(pool_mgr, alloc);
+        if(!block || ((size_t *) block)[1] != size) return ALLOC_FAIL;
+    } else if(pool_mgr->pool.policy == BITMAP) {
+        size_t first = _mem_bitmap_granule_of(pool_mgr, alloc);
+        if(first == pool_mgr->num_granules) return ALLOC_FAIL;
+        size_t count = size ? (size + pool_mgr->granule - 1) / pool_mgr->granule : 1;
+        if(_mem_bitmap_alloc_end(pool_mgr, first) - first != count) return ALLOC_FAIL;
+    } else {
+        unsigned slot = _mem_find_in_alloc_ix(pool_mgr, alloc);
+        if(slot == pool_mgr->alloc_ix_capacity
+           || pool_mgr->node_heap[pool_mgr->alloc_ix[slot].node].alloc_record.size != size) {
+            return ALLOC_FAIL;
+        }
+    }
+#else
+    (void) size; /* unused */
+#endif
+
+    return _mem_del_alloc(pool_mgr, alloc);
+}
+
+static alloc_status _mem_pool_reset(pool_mgr_pt pool_mgr) {
+    // saved walk positions don't survive a change
+    pool_mgr->generation ++;
+    MEM_PROFILE_DROP(pool_mgr, NULL);
+
+    // update metadata (num_allocs, alloc_size)
+    pool_mgr->pool.num_allocs = 0;
+    pool_mgr->pool.alloc_size = 0;
+
+    // arenas just drop the bump pointer
+    if(pool_mgr->pool.policy == ARENA) {
+        pool_mgr->arena_top = 0;
+        _mem_arena_lower(pool_mgr, 0);
+        pool_mgr->arena_last = (size_t) -1;
+        pool_mgr->pool.num_gaps = 1;
+        pool_mgr->pool.largest_gap = pool_mgr->pool.total_size;
+        return ALLOC_OK;
+    }
+
+    // bitmaps clear all bits, except for those past the pool
+    if(pool_mgr->pool.policy == BITMAP) {
+        _mem_bitmap_fill(pool_mgr, 0, pool_mgr->num_granules, 0);
+        memset(pool_mgr->bitmap_starts, 0, pool_mgr->bitmap_words * sizeof(uint64_t));
+        pool_mgr->pool.num_gaps = 1;
+        pool_mgr->pool.largest_gap = pool_mgr->pool.total_size;
+        _mem_reset_gap_stats(pool_mgr);
+        _mem_count_gap(pool_mgr, pool_mgr->pool.total_size);
+        return ALLOC_OK;
+    }
+
+    // tagged pools become a single free block
+    if(pool_mgr->tagged) {
+        _mem_tag_write(pool_mgr->pool.mem, pool_mgr->pool.total_size, 0);
+        pool_mgr->pool.num_gaps = 1;
+        pool_mgr->pool.largest_gap = pool_mgr->pool.total_size;
+        _mem_reset_gap_stats(pool_mgr);
+        _mem_count_gap(pool_mgr, pool_mgr->pool.total_size);
+        return ALLOC_OK;
+    }
+
+    // forget all nodes at once by dropping the high-water mark, then give
+    // each extent a single gap node, as when it was added
+    // note: this is O(num_extents), regardless of the number of allocations
+    _mem_clear_alloc_ix(pool_mgr);
+    pool_mgr->gap_ix_dirty = 0;
+    pool_mgr->consecutive_frees = 0;
+    _mem_reset_quick_lists(pool_mgr);
+    pool_mgr->free_nodes = NULL;
+    pool_mgr->node_hwm = 0;
+    pool_mgr->used_nodes = 0;
+    pool_mgr->pool.num_gaps = 0;
+    _mem_reset_gap_stats(pool_mgr);
+    node_pt prev = NULL;
+    for(unsigned i = 0; i < pool_mgr->num_extents; ++i) {
+        node_pt gap_node = _mem_get_unused_node(pool_mgr);
+        assert(gap_node);
+        gap_node->used = 1;
+        gap_node->allocated = 0;
+        gap_node->boundary = 1;
+        gap_node->purged = 0;
+        gap_node->deferred = 0;
+        gap_node->alloc_record.mem = pool_mgr->extents ? pool_mgr->extents[i].mem : pool_mgr->pool.mem;
+        gap_node->alloc_record.size = pool_mgr->extents ? pool_mgr->extents[i].size : pool_mgr->pool.total_size;
+        gap_node->prev = prev;
+        gap_node->next = NULL;
+        if(prev) prev->next = gap_node;
+        pool_mgr->used_nodes ++;
+        pool_mgr->tail = gap_node;
+        prev = gap_node;
+
+        alloc_status status = _mem_add_to_gap_ix(pool_mgr, gap_node->alloc_record.size, gap_node);
+        assert(status == ALLOC_OK);
+    }
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_pool_purge(pool_mgr_pt pool_mgr, size_t min_gap) {
+    // saved walk positions don't survive a change
+    pool_mgr->generation ++;
+    alloc_status status = ALLOC_OK;
+
+    // an arena has a single gap, above the bump pointer
+    if(pool_mgr->pool.policy == ARENA) {
+        size_t gap = pool_mgr->pool.total_size - pool_mgr->arena_top;
+        if(gap == 0 || gap < min_gap) return ALLOC_OK;
+        return _mem_purge_range(pool_mgr, pool_mgr->pool.mem + pool_mgr->arena_top, gap);
+    }
+
+    // a bitmap's gaps are its runs of clear bits
+    if(pool_mgr->pool.policy == BITMAP) {
+        size_t first = _mem_bitmap_next(pool_mgr->bitmap, 0, pool_mgr->num_granules, 0);
+        while(first < pool_mgr->num_granules) {
+            size_t end = _mem_bitmap_next(pool_mgr->bitmap, first, pool_mgr->num_granules, 1);
+            size_t gap = (end - first) * pool_mgr->granule;
+            if(gap >= min_gap
+               && _mem_purge_range(pool_mgr, pool_mgr->pool.mem + first * pool_mgr->granule, gap) != ALLOC_OK) {
+                status = ALLOC_FAIL;
+            }
+            first = _mem_bitmap_next(pool_mgr->bitmap, end, pool_mgr->num_granules, 0);
+        }
+        return status;
+    }
+
+    // a tagged pool's free blocks are found by walking all blocks
+    // note: the header and footer of a free block stay in place
+    if(pool_mgr->tagged) {
+        char *end = pool_mgr->pool.mem + pool_mgr->pool.total_size;
+        for(char *block = pool_mgr->pool.mem; block < end; block += *(size_t *) block & ~(size_t) 1) {
+            size_t tag = *(size_t *) block;
+            if((tag & 1) || tag < min_gap) continue;
+            if(_mem_purge_range(pool_mgr, block + MEM_TAG_HEADER_SIZE,
+                                tag - MEM_TAG_HEADER_SIZE - MEM_TAG_FOOTER_SIZE) != ALLOC_OK) {
+                status = ALLOC_FAIL;
+            }
+        }
+        return status;
+    }
+
+    // deferred frees have to be coalesced into gaps first, and indexed
+    if(pool_mgr->num_deferred) _mem_coalesce_deferred(pool_mgr);
+    if(_mem_rebuild_gap_ix(pool_mgr) != ALLOC_OK) return ALLOC_FAIL;
+
+    // the gap index is sorted by size, so walk it from the largest gap down
+    for(unsigned i = pool_mgr->pool.num_gaps; i > 0; --i) {
+        if(pool_mgr->gap_ix[i - 1].size < min_gap) break;
+        if(_mem_purge_gap(pool_mgr, pool_mgr->gap_ix[i - 1].node) != ALLOC_OK) status = ALLOC_FAIL;
+    }
+
+    return status;
+}
+
+static alloc_status _mem_pool_trim(pool_mgr_pt pool_mgr) {
+    // saved walk positions don't survive a change
+    pool_mgr->generation ++;
+    alloc_status status;
+
+    // an arena's trailing gap is everything above the bump pointer
+    if(pool_mgr->pool.policy == ARENA) {
+        size_t new_size = _mem_page_round(pool_mgr->arena_top ? pool_mgr->arena_top : 1);
+        if(!pool_mgr->reserved_size || new_size >= pool_mgr->pool.total_size) {
+            return _mem_pool_purge(pool_mgr, 0);
+        }
+        size_t committed = _mem_page_round(pool_mgr->pool.total_size);
+        if(madvise(pool_mgr->pool.mem + new_size, committed - new_size, MADV_DONTNEED) != 0
+           || mprotect(pool_mgr->pool.mem + new_size, committed - new_size, PROT_NONE) != 0) {
+            return ALLOC_FAIL;
+        }
+        pool_mgr->pool.total_size = new_size;
+        pool_mgr->pool.num_gaps = (pool_mgr->arena_top < new_size) ? 1 : 0;
+        pool_mgr->pool.largest_gap = new_size - pool_mgr->arena_top;
+        return ALLOC_OK;
+    }
+
+    // a bitmap's trailing gap starts after its last set bit
+    if(pool_mgr->pool.policy == BITMAP) {
+        size_t first = _mem_bitmap_prev_set(pool_mgr->bitmap, pool_mgr->num_granules) + 1;
+        if(first >= pool_mgr->num_granules) return ALLOC_OK;
+        return _mem_purge_range(pool_mgr, pool_mgr->pool.mem + first * pool_mgr->granule,
+                                (pool_mgr->num_granules - first) * pool_mgr->granule);
+    }
+
+    // the footer at the end of a tagged pool belongs to its last block
+    if(pool_mgr->tagged) {
+        char *end = pool_mgr->pool.mem + pool_mgr->pool.total_size;
+        size_t tag = *(size_t *)(end - MEM_TAG_FOOTER_SIZE);
+        if(tag & 1) return ALLOC_OK;
+        return _mem_purge_range(pool_mgr, end - tag + MEM_TAG_HEADER_SIZE,
+                                tag - MEM_TAG_HEADER_SIZE - MEM_TAG_FOOTER_SIZE);
+    }
+
+    // deferred frees have to be coalesced into gaps first, and indexed
+    if(pool_mgr->num_deferred) _mem_coalesce_deferred(pool_mgr);
+    if(_mem_rebuild_gap_ix(pool_mgr) != ALLOC_OK) return ALLOC_FAIL;
+
+    // release trailing extents that are entirely free
+    node_pt tail = pool_mgr->tail;
+    while(pool_mgr->expandable && tail->boundary && !tail->allocated
+          && tail->alloc_record.mem != pool_mgr->pool.mem) {
+        status = _mem_release_extent(pool_mgr, tail);
+        assert(status == ALLOC_OK);
+        tail = pool_mgr->tail;
+    }
+    // nothing to trim if the pool ends in an allocation
+    if(tail->allocated) return ALLOC_OK;
+
+    // a reservation can be decommitted down to the page after the last allocation
+    size_t top = (size_t) (tail->alloc_record.mem - pool_mgr->pool.mem);
+    size_t new_size = _mem_page_round(top ? top : 1);
+    if(pool_mgr->reserved_size && new_size < pool_mgr->pool.total_size) {
+        size_t committed = _mem_page_round(pool_mgr->pool.total_size);
+        if(madvise(pool_mgr->pool.mem + new_size, committed - new_size, MADV_DONTNEED) != 0
+           || mprotect(pool_mgr->pool.mem + new_size, committed - new_size, PROT_NONE) != 0) {
+            return ALLOC_FAIL;
+        }
+        size_t trimmed = pool_mgr->pool.total_size - new_size;
+        pool_mgr->pool.total_size = new_size;
+
+        status = _mem_remove_from_gap_ix(pool_mgr, tail->alloc_record.size, tail);
+        assert(status == ALLOC_OK);
+        tail->alloc_record.size -= trimmed;
+        if(tail->alloc_record.size == 0) {
+            //   the gap is gone, so unlink its node and update metadata (used_nodes)
+            tail->prev->next = NULL;
+            pool_mgr->tail = tail->prev;
+            _mem_put_unused_node(pool_mgr, tail);
+            pool_mgr->used_nodes --;
+            return ALLOC_OK;
+        }
+        status = _mem_add_to_gap_ix(pool_mgr, tail->alloc_record.size, tail);
+        if(status != ALLOC_OK) return status;
+    }
+
+    // other pools can't shrink their backing store in place, so purge the gap
+    return _mem_purge_gap(pool_mgr, tail);
+}
+
+static void _mem_begin_change(pool_mgr_pt pool_mgr) {
+    // make the sequence number odd before any change becomes visible
+    // note: a pool has a single writer, so this needs no atomic increment
+    unsigned seq = atomic_load_explicit(&pool_mgr->stats_seq, memory_order_relaxed);
+    atomic_store_explicit(&pool_mgr->stats_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void _mem_end_change(pool_mgr_pt pool_mgr) {
+    // and even again once all changes are visible
+    unsigned seq = atomic_load_explicit(&pool_mgr->stats_seq, memory_order_relaxed);
+    atomic_store_explicit(&pool_mgr->stats_seq, seq + 1, memory_order_release);
+}
+
+// note: mem_pool_snapshot's reads race with the owner's writes by design,
+// and are thrown away if they overlapped one
+__attribute__((no_sanitize("thread")))
+static void _mem_copy_stats(pool_mgr_pt pool_mgr, pool_stats_t *stats, alloc_policy *policy) {
+    // everything is kept up to date already, so this only copies it
+    // note: the policy too, if asked for, as mem_pool_open_bitmap changes it
+    if(policy) *policy = pool_mgr->pool.policy;
+    // note: an arena's only gap is above the bump pointer
+    stats->total_size = pool_mgr->pool.total_size;
+    stats->alloc_size = pool_mgr->pool.alloc_size;
+    stats->largest_gap = pool_mgr->pool.largest_gap;
+    stats->num_allocs = pool_mgr->pool.num_allocs;
+    stats->num_gaps = pool_mgr->pool.num_gaps;
+    if(pool_mgr->pool.policy == ARENA) {
+        memset(stats->gap_histogram, 0, sizeof(stats->gap_histogram));
+        stats->gap_size = pool_mgr->pool.total_size - pool_mgr->arena_top;
+        if(stats->num_gaps) stats->gap_histogram[_mem_gap_bucket(stats->gap_size)] = 1;
+    } else {
+        memcpy(stats->gap_histogram, pool_mgr->gap_histogram, sizeof(stats->gap_histogram));
+        stats->gap_size = pool_mgr->gap_size;
+    }
+
+    // the share of free bytes that the largest gap can't hand out at once
+    stats->mean_gap = stats->num_gaps ? stats->gap_size / stats->num_gaps : 0;
+    stats->fragmentation = stats->gap_size
+                           ? 1.0 - (double) stats->largest_gap / (double) stats->gap_size : 0.0;
+}
+
+static void _mem_snapshot_pool(pool_mgr_pt pool_mgr, pool_stats_t *stats, alloc_policy *policy) {
+    // copy the stats between two reads of the same even sequence number,
+    // retrying if the owner changed the pool meanwhile (the owner never waits)
+    for(;;) {
+        unsigned seq = atomic_load_explicit(&pool_mgr->stats_seq, memory_order_acquire);
+        if(seq & 1) {
+            sched_yield();
+            continue;
+        }
+        _mem_copy_stats(pool_mgr, stats, policy);
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&pool_mgr->stats_seq, memory_order_relaxed) == seq) return;
+    }
+}
+
+static node_pt _mem_find_gap(pool_mgr_pt pool_mgr, size_t size) {
+    node_pt gap_node = NULL;
+    unsigned length = 0; // nodes or entries looked at
+    MEM_COUNT(pool_mgr, searches, 1);
+    // if FIRST_FIT, then find the first sufficient node in the node heap
+    if(pool_mgr->pool.policy == FIRST_FIT) {
+        node_pt current_node = pool_mgr->node_heap;
+        while(current_node) {
+            length ++;
+            if(current_node->allocated == 0 && !current_node->deferred
+               && current_node->alloc_record.size >= size) {
+                gap_node = current_node;  // Found node //
+                break;
+            }
+            current_node = current_node->next;
+        }
+        MEM_COUNT(pool_mgr, nodes_visited, length);
+    }
+    // if BEST_FIT, then find the first sufficient node in the gap index
+    else {
+        gap_pt gap_ix = pool_mgr->gap_ix;  // sorted in order of increasing size //
+        for(unsigned i = 0; i < pool_mgr->pool.num_gaps; ++i){
+            length ++;
+            if(gap_ix[i].size >= size) {
+                gap_node = gap_ix[i].node;  // Found node //
+                break;
+            }
+        }
+        MEM_COUNT(pool_mgr, entries_examined, length);
+    }
+    MEM_PROBE4(search, pool_mgr, size, gap_node ? gap_node->alloc_record.mem : NULL, length);
+
+    return gap_node;
+}
+
+static node_pt _mem_get_unused_node(pool_mgr_pt pool_mgr) {
+    // note: the caller expands the node heap beforehand, if necessary
+    // reuse a released node first, then one past the high-water mark
+    node_pt node = pool_mgr->free_nodes;
+    if(node) {
+        pool_mgr->free_nodes = node->next;
+    } else if(pool_mgr->node_hwm < pool_mgr->total_nodes) {
+        node = &pool_mgr->node_heap[pool_mgr->node_hwm ++];
+    }
+
+    return node;
+}
+
+static void _mem_put_unused_node(pool_mgr_pt pool_mgr, node_pt node) {
+    // note: the caller unlinks the node from the list and updates used_nodes
+    node->used = 0;
+    node->prev = NULL;
+    node->next = pool_mgr->free_nodes;
+    pool_mgr->free_nodes = node;
+}
+
+static void * _mem_arena_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    size_t top = pool_mgr->arena_top + size;
+    if(top < size) return NULL;
+
+    // a reservation can commit more pages, other arenas are fixed
+    if(top > pool_mgr->pool.total_size) {
+        size_t new_size = _mem_page_round(top);
+        if(!pool_mgr->reserved_size || new_size > pool_mgr->reserved_size) return NULL;
+        size_t committed = _mem_page_round(pool_mgr->pool.total_size);
+        if(new_size > committed
+           && mprotect(pool_mgr->pool.mem + committed, new_size - committed,
+                       PROT_READ | PROT_WRITE) != 0) return NULL;
+        pool_mgr->pool.total_size = new_size;
+    }
+
+    // bump the pointer and update metadata (num_allocs, alloc_size, num_gaps)
+    char *mem = pool_mgr->pool.mem + pool_mgr->arena_top;
+    pool_mgr->arena_last = pool_mgr->arena_top;
+    pool_mgr->arena_top = top;
+    pool_mgr->pool.num_allocs ++;
+    pool_mgr->pool.alloc_size += size;
+    pool_mgr->pool.num_gaps = (top < pool_mgr->pool.total_size) ? 1 : 0;
+    pool_mgr->pool.largest_gap = pool_mgr->pool.total_size - top;
+
+    return mem;
+}
+
+static void _mem_arena_lower(pool_mgr_pt pool_mgr, size_t top) {
+    // a new epoch: older marks stay valid only at or below top, as anything
+    // above it may be allocated over again
+    // note: the floors keep, for each epoch that ended, the lowest the bump
+    // pointer went since, so floors that top goes below are superseded
+    arena_floor_t *floors = pool_mgr->arena_floors;
+    unsigned num_floors = pool_mgr->num_arena_floors;
+    while(num_floors > 0 && floors[num_floors - 1].top >= top) num_floors --;
+    if(num_floors == MEM_ARENA_FLOORS) {
+        //   out of room: merge the oldest two into the lower floor and the
+        //   later epoch, which can only reject more marks, never fewer
+        floors[1].top = floors[0].top;
+        memmove(floors, floors + 1, (num_floors - 1) * sizeof(arena_floor_t));
+        num_floors --;
+    }
+    pool_mgr->arena_epoch ++;
+    floors[num_floors].epoch = pool_mgr->arena_epoch;
+    floors[num_floors].top = top;
+    pool_mgr->num_arena_floors = num_floors + 1;
+}
+
+static int _mem_arena_mark_valid(pool_mgr_pt pool_mgr, pool_mark_t mark) {
+    // the oldest floor from after the mark is the lowest the bump pointer went since
+    for(unsigned i = 0; i < pool_mgr->num_arena_floors; ++i) {
+        if(pool_mgr->arena_floors[i].epoch > mark.epoch) return mark.top <= pool_mgr->arena_floors[i].top;
+    }
+    return 1;
+}
+
+static void * _mem_tagged_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    // a block is a whole number of alignment units, tags included
+    if(size > pool_mgr->pool.total_size) return NULL;
+    size_t needed = (size + MEM_TAG_HEADER_SIZE + MEM_TAG_FOOTER_SIZE + MEM_TAG_ALIGN - 1)
+                    & ~(MEM_TAG_ALIGN - 1);
+    if(needed < MEM_TAG_MIN_BLOCK) needed = MEM_TAG_MIN_BLOCK;
+    if(needed > pool_mgr->pool.largest_gap) return NULL;
+
+    // walk the blocks in address order, stepping by the size in each header
+    // note: best fit takes the smallest block, the lowest-addressed on ties
+    char *end = pool_mgr->pool.mem + pool_mgr->pool.total_size;
+    char *fit = NULL;
+    size_t fit_size = 0;
+    unsigned length = 0; // blocks looked at
+    for(char *block = pool_mgr->pool.mem; block < end; block += *(size_t *) block & ~(size_t) 1) {
+        size_t tag = *(size_t *) block;
+        length ++;
+        if((tag & 1) || tag < needed) continue;
+        if(!fit || tag < fit_size) {
+            fit = block;
+            fit_size = tag;
+        }
+        if(pool_mgr->pool.policy == FIRST_FIT || tag == needed) break;
+    }
+    MEM_COUNT(pool_mgr, searches, 1);
+    MEM_COUNT(pool_mgr, nodes_visited, length);
+    MEM_PROBE4(search, pool_mgr, size, fit, length);
+    if(!fit) return NULL;
+    int was_largest = (fit_size == pool_mgr->pool.largest_gap);
+    _mem_uncount_gap(pool_mgr, fit_size);
+
+    // split off the rest as a free block, if it's large enough for one
+    if(fit_size - needed >= MEM_TAG_MIN_BLOCK) {
+        _mem_tag_write(fit + needed, fit_size - needed, 0);
+        _mem_count_gap(pool_mgr, fit_size - needed);
+        MEM_COUNT(pool_mgr, splits, 1);
+        MEM_PROBE4(split, pool_mgr, fit, needed, fit_size - needed);
+        fit_size = needed;
+    } else {
+        pool_mgr->pool.num_gaps --;
+    }
+    _mem_tag_write(fit, fit_size, 1);
+    ((size_t *) fit)[1] = size;
+
+    // only taking from the largest free block can make it smaller
+    if(was_largest) pool_mgr->pool.largest_gap = _mem_tagged_largest(pool_mgr);
+
+    // update metadata (num_allocs, alloc_size)
+    pool_mgr->pool.num_allocs ++;
+    pool_mgr->pool.alloc_size += size;
+
+    return fit + MEM_TAG_HEADER_SIZE;
+}
+
+static alloc_status _mem_tagged_free(pool_mgr_pt pool_mgr, void *alloc) {
+    char *block = _mem_tagged_block(pool_mgr, alloc);
+    if(!block) return ALLOC_FAIL;
+    size_t size = *(size_t *) block & ~(size_t) 1;
+
+    // update metadata (num_allocs, alloc_size)
+    pool_mgr->pool.num_allocs --;
+    pool_mgr->pool.alloc_size -= ((size_t *) block)[1];
+
+    // clear the header first, so a header left inside a merged block
+    // never passes for an allocation again
+    *(size_t *) block = size;
+
+    // if the next block is free, merge it in
+    char *end = pool_mgr->pool.mem + pool_mgr->pool.total_size;
+    if(block + size < end && !(*(size_t *)(block + size) & 1)) {
+        size_t next_size = *(size_t *)(block + size);
+        size += next_size;
+        pool_mgr->pool.num_gaps --;
+        _mem_uncount_gap(pool_mgr, next_size);
+        MEM_COUNT(pool_mgr, coalesces, 1);
+        MEM_PROBE3(coalesce, pool_mgr, block, size);
+    }
+    // if the previous block is free, merge into it (its footer is right before)
+    if(block > pool_mgr->pool.mem && !(*(size_t *)(block - MEM_TAG_FOOTER_SIZE) & 1)) {
+        size_t prev_size = *(size_t *)(block - MEM_TAG_FOOTER_SIZE);
+        block -= prev_size;
+        size += prev_size;
+        pool_mgr->pool.num_gaps --;
+        _mem_uncount_gap(pool_mgr, prev_size);
+        MEM_COUNT(pool_mgr, coalesces, 1);
+        MEM_PROBE3(coalesce, pool_mgr, block, size);
+    }
+    _mem_tag_write(block, size, 0);
+    pool_mgr->pool.num_gaps ++;
+    _mem_count_gap(pool_mgr, size);
+    if(size > pool_mgr->pool.largest_gap) pool_mgr->pool.largest_gap = size;
+
+    // return the pages of a large enough block to the OS
+    if(pool_mgr->purge_threshold && size >= pool_mgr->purge_threshold) {
+        return _mem_purge_range(pool_mgr, block + MEM_TAG_HEADER_SIZE,
+                                size - MEM_TAG_HEADER_SIZE - MEM_TAG_FOOTER_SIZE);
+    }
+
+    return ALLOC_OK;
+}
+
+static char * _mem_tagged_block(pool_mgr_pt pool_mgr, void *alloc) {
+    // the header has to be in the pool, on a block boundary
+    char *mem = pool_mgr->pool.mem;
+    char *end = mem + pool_mgr->pool.total_size;
+    if((char *) alloc < mem + MEM_TAG_HEADER_SIZE || (char *) alloc >= end
+       || ((size_t) ((char *) alloc - mem) - MEM_TAG_HEADER_SIZE) % MEM_TAG_ALIGN) return NULL;
+    char *block = (char *) alloc - MEM_TAG_HEADER_SIZE;
+
+    // and its tags have to agree on an allocated block
+    // note: this is a sanity check, a pointer into an allocation may still pass
+    size_t tag = *(size_t *) block;
+    size_t size = tag & ~(size_t) 1;
+    if(!(tag & 1) || size < MEM_TAG_MIN_BLOCK || size > (size_t) (end - block)
+       || *(size_t *)(block + size - MEM_TAG_FOOTER_SIZE) != tag) return NULL;
+
+    return block;
+}
+
+static size_t _mem_tagged_largest(pool_mgr_pt pool_mgr) {
+    // walk all blocks for the largest free one
+    size_t largest = 0;
+    char *end = pool_mgr->pool.mem + pool_mgr->pool.total_size;
+    for(char *block = pool_mgr->pool.mem; block < end; block += *(size_t *) block & ~(size_t) 1) {
+        size_t tag = *(size_t *) block;
+        if(!(tag & 1) && tag > largest) largest = tag;
+    }
+
+    return largest;
+}
+
+static void _mem_tag_write(char *block, size_t size, unsigned allocated) {
+    // sizes are multiples of the alignment, so the low bit is free for the flag
+    size_t tag = size | (allocated ? 1 : 0);
+    *(size_t *) block = tag;
+    *(size_t *)(block + size - MEM_TAG_FOOTER_SIZE) = tag;
+}
+
+static alloc_status _mem_init_bitmap(pool_mgr_pt pool_mgr, size_t granule) {
+    // the pool is cut down to whole granules
+    size_t num_granules = pool_mgr->pool.total_size / granule;
+    if(num_granules == 0) return ALLOC_FAIL;
+    size_t words = (num_granules + MEM_BITMAP_WORD_BITS - 1) / MEM_BITMAP_WORD_BITS;
+    size_t summary_words = (words + MEM_BITMAP_WORD_BITS - 1) / MEM_BITMAP_WORD_BITS;
+
+    // allocate the bitmap, the start bits and the summary as a single block
+    uint64_t *maps = (uint64_t *)calloc(2 * words + summary_words, sizeof(uint64_t));
+    if(!maps) return ALLOC_FAIL;
+    pool_mgr->granule = granule;
+    pool_mgr->num_granules = num_granules;
+    pool_mgr->bitmap_words = words;
+    pool_mgr->bitmap = maps;
+    pool_mgr->bitmap_starts = maps + words;
+    pool_mgr->bitmap_summary = maps + 2 * words;
+    pool_mgr->pool.total_size = num_granules * granule;
+    pool_mgr->pool.largest_gap = pool_mgr->pool.total_size;
+    _mem_reset_gap_stats(pool_mgr);
+    _mem_count_gap(pool_mgr, pool_mgr->pool.total_size);
+
+    // bits past the end of the pool (and of the bitmap) look allocated,
+    // so no search runs off the end
+    size_t tail = num_granules % MEM_BITMAP_WORD_BITS;
+    if(tail) pool_mgr->bitmap[words - 1] = ~(uint64_t) 0 << tail;
+    tail = words % MEM_BITMAP_WORD_BITS;
+    if(tail) pool_mgr->bitmap_summary[summary_words - 1] = ~(uint64_t) 0 << tail;
+
+    return ALLOC_OK;
+}
+
+static void * _mem_bitmap_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    // every allocation takes whole granules, at least one
+    size_t count = size ? (size - 1) / pool_mgr->granule + 1 : 1;
+    if(count > pool_mgr->pool.largest_gap / pool_mgr->granule) return NULL;
+    MEM_COUNT(pool_mgr, searches, 1);
+    size_t first = _mem_bitmap_find(pool_mgr, count);
+    if(first == pool_mgr->num_granules) return NULL;
+    // note: the run found starts at first
+    size_t run = _mem_bitmap_next(pool_mgr->bitmap, first, pool_mgr->num_granules, 1) - first;
+
+    // the run may have had gaps on either side, or none
+    size_t end = first + count;
+    int gap_before = first > 0
+                     && !((pool_mgr->bitmap[(first - 1) / MEM_BITMAP_WORD_BITS]
+                           >> ((first - 1) % MEM_BITMAP_WORD_BITS)) & 1);
+    int gap_after = end < pool_mgr->num_granules
+                    && !((pool_mgr->bitmap[end / MEM_BITMAP_WORD_BITS]
+                          >> (end % MEM_BITMAP_WORD_BITS)) & 1);
+    pool_mgr->pool.num_gaps += gap_before + gap_after - 1;
+    _mem_uncount_gap(pool_mgr, run * pool_mgr->granule);
+    if(run > count) {
+        _mem_count_gap(pool_mgr, (run - count) * pool_mgr->granule);
+        MEM_COUNT(pool_mgr, splits, 1);
+        MEM_PROBE4(split, pool_mgr, pool_mgr->pool.mem + first * pool_mgr->granule,
+                   count * pool_mgr->granule, (run - count) * pool_mgr->granule);
+    }
+
+    _mem_bitmap_fill(pool_mgr, first, count, 1);
+    pool_mgr->bitmap_starts[first / MEM_BITMAP_WORD_BITS] |=
+            (uint64_t) 1 << (first % MEM_BITMAP_WORD_BITS);
+
+    // only taking from the largest run can make it smaller
+    if(run * pool_mgr->granule == pool_mgr->pool.largest_gap) {
+        pool_mgr->pool.largest_gap = _mem_bitmap_largest(pool_mgr);
+    }
+
+    // update metadata (num_allocs, alloc_size)
+    // note: alloc_size counts whole granules, as that is what a free returns
+    pool_mgr->pool.num_allocs ++;
+    pool_mgr->pool.alloc_size += count * pool_mgr->granule;
+
+    return pool_mgr->pool.mem + first * pool_mgr->granule;
+}
+
+static alloc_status _mem_bitmap_free(pool_mgr_pt pool_mgr, void *alloc) {
+    size_t first = _mem_bitmap_granule_of(pool_mgr, alloc);
+    if(first == pool_mgr->num_granules) return ALLOC_FAIL;
+    size_t end = _mem_bitmap_alloc_end(pool_mgr, first);
+    size_t count = end - first;
+
+    // the freed run merges with the gaps on either side, if any
+    int gap_before = first > 0
+                     && !((pool_mgr->bitmap[(first - 1) / MEM_BITMAP_WORD_BITS]
+                           >> ((first - 1) % MEM_BITMAP_WORD_BITS)) & 1);
+    int gap_after = end < pool_mgr->num_granules
+                    && !((pool_mgr->bitmap[end / MEM_BITMAP_WORD_BITS]
+                          >> (end % MEM_BITMAP_WORD_BITS)) & 1);
+    pool_mgr->pool.num_gaps += 1 - gap_before - gap_after;
+    MEM_COUNT(pool_mgr, coalesces, gap_before + gap_after);
+
+    _mem_bitmap_fill(pool_mgr, first, count, 0);
+    pool_mgr->bitmap_starts[first / MEM_BITMAP_WORD_BITS] &=
+            ~((uint64_t) 1 << (first % MEM_BITMAP_WORD_BITS));
+
+    // update metadata (num_allocs, alloc_size)
+    pool_mgr->pool.num_allocs --;
+    pool_mgr->pool.alloc_size -= count * pool_mgr->granule;
+
+    // the merged gap may be the new largest one
+    if(gap_before) {
+        size_t before = _mem_bitmap_prev_set(pool_mgr->bitmap, first) + 1;
+        _mem_uncount_gap(pool_mgr, (first - before) * pool_mgr->granule);
+        first = before;
+    }
+    if(gap_after) {
+        size_t after = _mem_bitmap_next(pool_mgr->bitmap, end, pool_mgr->num_granules, 1);
+        _mem_uncount_gap(pool_mgr, (after - end) * pool_mgr->granule);
+        end = after;
+    }
+    size_t gap = (end - first) * pool_mgr->granule;
+    _mem_count_gap(pool_mgr, gap);
+    if(gap_before || gap_after) {
+        MEM_PROBE3(coalesce, pool_mgr, pool_mgr->pool.mem + first * pool_mgr->granule, gap);
+    }
+    if(gap > pool_mgr->pool.largest_gap) pool_mgr->pool.largest_gap = gap;
+
+    // return the pages of a large enough gap to the OS
+    if(pool_mgr->purge_threshold && gap >= pool_mgr->purge_threshold) {
+        return _mem_purge_range(pool_mgr, pool_mgr->pool.mem + first * pool_mgr->granule, gap);
+    }
+
+    return ALLOC_OK;
+}
+
+static size_t _mem_bitmap_largest(pool_mgr_pt pool_mgr) {
+    // walk the runs of clear bits for the longest one
+    size_t largest = 0;
+    size_t first = _mem_bitmap_next(pool_mgr->bitmap, 0, pool_mgr->num_granules, 0);
+    while(first < pool_mgr->num_granules) {
+        size_t end = _mem_bitmap_next(pool_mgr->bitmap, first, pool_mgr->num_granules, 1);
+        if(end - first > largest) largest = end - first;
+        first = _mem_bitmap_next(pool_mgr->bitmap, end, pool_mgr->num_granules, 0);
+    }
+
+    return largest * pool_mgr->granule;
+}
+
+static size_t _mem_bitmap_granule_of(pool_mgr_pt pool_mgr, void *alloc) {
+    // an allocation starts on a granule with its start bit set
+    // returns num_granules, if alloc isn't one
+    char *mem = (char *) alloc;
+    if(mem < pool_mgr->pool.mem || mem >= pool_mgr->pool.mem + pool_mgr->pool.total_size
+       || (size_t) (mem - pool_mgr->pool.mem) % pool_mgr->granule) return pool_mgr->num_granules;
+    size_t first = (size_t) (mem - pool_mgr->pool.mem) / pool_mgr->granule;
+    if(!((pool_mgr->bitmap_starts[first / MEM_BITMAP_WORD_BITS]
+          >> (first % MEM_BITMAP_WORD_BITS)) & 1)) return pool_mgr->num_granules;
+
+    return first;
+}
+
+static size_t _mem_bitmap_alloc_end(pool_mgr_pt pool_mgr, size_t first) {
+    // an allocation ends at the next clear bit, or where the next one starts
+    size_t end = _mem_bitmap_next(pool_mgr->bitmap, first + 1, pool_mgr->num_granules, 0);
+
+    return _mem_bitmap_next(pool_mgr->bitmap_starts, first + 1, end, 1);
+}
+
+static size_t _mem_bitmap_find(pool_mgr_pt pool_mgr, size_t count) {
+    // find the lowest run of count clear bits, a word at a time
+    // returns num_granules, if there is none
+    size_t run_first = 0, run_length = 0;
+    for(size_t w = 0; w < pool_mgr->bitmap_words; ) {
+        // the summary skips a whole stretch of full words at once
+        if(w % MEM_BITMAP_WORD_BITS == 0
+           && pool_mgr->bitmap_summary[w / MEM_BITMAP_WORD_BITS] == ~(uint64_t) 0) {
+            run_length = 0;
+            w += MEM_BITMAP_WORD_BITS;
+            continue;
+        }
+        uint64_t word = pool_mgr->bitmap[w];
+        if(word == ~(uint64_t) 0) {
+            run_length = 0;
+            ++w;
+            continue;
+        }
+
+        // alternate between the clear and the set bits of the word
+        size_t bit = 0;
+        while(bit < MEM_BITMAP_WORD_BITS) {
+            uint64_t rest = word >> bit;
+            size_t clear = rest ? (size_t) __builtin_ctzll(rest) : MEM_BITMAP_WORD_BITS - bit;
+            if(clear) {
+                if(run_length == 0) run_first = w * MEM_BITMAP_WORD_BITS + bit;
+                run_length += clear;
+                if(run_length >= count) return run_first;
+                bit += clear;
+                if(bit == MEM_BITMAP_WORD_BITS) break;
+            }
+            rest = ~word >> bit;
+            bit += rest ? (size_t) __builtin_ctzll(rest) : MEM_BITMAP_WORD_BITS - bit;
+            run_length = 0;
+        }
+        ++w;
+    }
+
+    return pool_mgr->num_granules;
+}
+
+static void _mem_bitmap_fill(pool_mgr_pt pool_mgr, size_t first, size_t count, unsigned allocated) {
+    // set or clear the bits a word at a time, keeping the summary up to date
+    size_t end = first + count;
+    while(first < end) {
+        size_t w = first / MEM_BITMAP_WORD_BITS;
+        size_t bit = first % MEM_BITMAP_WORD_BITS;
+        size_t n = MEM_BITMAP_WORD_BITS - bit;
+        if(n > end - first) n = end - first;
+        uint64_t mask = (n == MEM_BITMAP_WORD_BITS) ? ~(uint64_t) 0
+                                                    : (((uint64_t) 1 << n) - 1) << bit;
+        if(allocated) pool_mgr->bitmap[w] |= mask;
+        else pool_mgr->bitmap[w] &= ~mask;
+
+        uint64_t summary_bit = (uint64_t) 1 << (w % MEM_BITMAP_WORD_BITS);
+        if(pool_mgr->bitmap[w] == ~(uint64_t) 0) {
+            pool_mgr->bitmap_summary[w / MEM_BITMAP_WORD_BITS] |= summary_bit;
+        } else {
+            pool_mgr->bitmap_summary[w / MEM_BITMAP_WORD_BITS] &= ~summary_bit;
+        }
+        first += n;
+    }
+}
+
+static size_t _mem_bitmap_next(const uint64_t *map, size_t from, size_t limit, unsigned set) {
+    // find the first bit at or after from that is set (or clear), a word at a time
+    // returns limit, if there is none before it
+    while(from < limit) {
+        uint64_t word = set ? map[from / MEM_BITMAP_WORD_BITS] : ~map[from / MEM_BITMAP_WORD_BITS];
+        word >>= from % MEM_BITMAP_WORD_BITS;
+        if(word) {
+            from += (size_t) __builtin_ctzll(word);
+            return from < limit ? from : limit;
+        }
+        from = (from / MEM_BITMAP_WORD_BITS + 1) * MEM_BITMAP_WORD_BITS;
+    }
+
+    return limit;
+}
+
+static size_t _mem_bitmap_prev_set(const uint64_t *map, size_t before) {
+    // find the last set bit before the given one, a word at a time
+    // returns (size_t) -1, if there is none
+    while(before > 0) {
+        size_t w = (before - 1) / MEM_BITMAP_WORD_BITS;
+        size_t bits = before - w * MEM_BITMAP_WORD_BITS;
+        uint64_t word = map[w];
+        if(bits < MEM_BITMAP_WORD_BITS) word &= ((uint64_t) 1 << bits) - 1;
+        if(word) return w * MEM_BITMAP_WORD_BITS + MEM_BITMAP_WORD_BITS - 1
+                        - (size_t) __builtin_clzll(word);
+        before = w * MEM_BITMAP_WORD_BITS;
+    }
+
+    return (size_t) -1;
+}
+
+static alloc_status _mem_walk_step(pool_mgr_pt pool_mgr, pool_cursor_t *cursor, pool_record_pt record) {
+    // the saved position holds while the pool is unchanged, otherwise the
+    // walk resumes at the segment containing the saved address
+    int unchanged = cursor->started && cursor->generation == pool_mgr->generation;
+    char *mem = pool_mgr->pool.mem;
+    char *next = NULL;
+
+    if(pool_mgr->pool.policy == ARENA) {
+        // [0, top) is one allocation segment, [top, total) the gap
+        size_t offset = cursor->started ? (size_t) (cursor->next - mem) : 0;
+        if(offset >= pool_mgr->pool.total_size) return ALLOC_FAIL;
+        if(offset < pool_mgr->arena_top) {
+            record->mem = mem;
+            record->size = pool_mgr->arena_top;
+            record->allocated = 1;
+            record->purged = 0;
+        } else {
+            record->mem = mem + pool_mgr->arena_top;
+            record->size = pool_mgr->pool.total_size - pool_mgr->arena_top;
+            record->allocated = 0;
+            record->purged = 0;
+        }
+        next = record->mem + record->size;
+    } else if(pool_mgr->tagged) {
+        // blocks follow each other, by the sizes in their headers
+        char *end = mem + pool_mgr->pool.total_size;
+        char *block = mem;
+        if(unchanged) {
+            block = cursor->next;
+        } else if(cursor->started) {
+            while(block < end && block + (*(size_t *) block & ~(size_t) 1) <= cursor->next) {
+                block += *(size_t *) block & ~(size_t) 1;
+            }
+        }
+        if(block >= end) return ALLOC_FAIL;
+        record->mem = block;
+        record->size = *(size_t *) block & ~(size_t) 1;
+        record->allocated = *(size_t *) block & 1;
+        record->purged = 0;
+        next = block + record->size;
+    } else if(pool_mgr->pool.policy == BITMAP) {
+        // a run of clear bits is a gap, an allocation ends at the next start bit
+        size_t first = cursor->started ? (size_t) (cursor->next - mem) / pool_mgr->granule : 0;
+        if(first >= pool_mgr->num_granules) return ALLOC_FAIL;
+        unsigned allocated = (pool_mgr->bitmap[first / MEM_BITMAP_WORD_BITS]
+                              >> (first % MEM_BITMAP_WORD_BITS)) & 1;
+        if(cursor->started && !unchanged) {
+            first = allocated ? _mem_bitmap_prev_set(pool_mgr->bitmap_starts, first + 1)
+                              : _mem_bitmap_prev_set(pool_mgr->bitmap, first) + 1;
+        }
+        size_t end = allocated ? _mem_bitmap_alloc_end(pool_mgr, first)
+                               : _mem_bitmap_next(pool_mgr->bitmap, first, pool_mgr->num_granules, 1);
+        record->mem = mem + first * pool_mgr->granule;
+        record->size = (end - first) * pool_mgr->granule;
+        record->allocated = allocated;
+        record->purged = 0;
+        next = record->mem + record->size;
+    } else {
+        // nodes are in list order, which is address order within each extent
+        node_pt node = pool_mgr->node_heap;
+        if(unchanged) {
+            node = (cursor->pos < pool_mgr->node_hwm) ? &pool_mgr->node_heap[cursor->pos] : NULL;
+        } else if(cursor->started) {
+            while(node && !(node->alloc_record.mem <= cursor->next
+                            && cursor->next < node->alloc_record.mem + node->alloc_record.size)) {
+                node = node->next;
+            }
+        }
+        if(!node) return ALLOC_FAIL;
+        record->mem = node->alloc_record.mem;
+        record->size = node->alloc_record.size;
+        record->allocated = node->allocated;
+        record->purged = node->purged;
+        next = node->next ? node->next->alloc_record.mem : record->mem + record->size;
+        cursor->pos = node->next ? (size_t) (node->next - pool_mgr->node_heap) : pool_mgr->node_hwm;
+    }
+
+    // remember where to go on from
+    cursor->next = next;
+    cursor->generation = pool_mgr->generation;
+    cursor->started = 1;
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_expand_pool(pool_mgr_pt pool_mgr, size_t size) {
+    // expandable pools grow by another extent
+    if(pool_mgr->expandable) return _mem_add_extent(pool_mgr, size);
+    // only pools over a reservation can grow in place
+    if(!pool_mgr->reserved_size) return ALLOC_FAIL;
+
+    // the allocation will extend the trailing gap, if there is one
+    node_pt tail = pool_mgr->tail;
+    size_t tail_gap = tail->allocated ? 0 : tail->alloc_record.size;
+    assert(size > tail_gap);
+
+    // grow to the page boundary past the top of the new allocation
+    // note: check against the rest of the reservation first, so that neither
+    // the sum nor the rounding can wrap around
+    size_t old_size = pool_mgr->pool.total_size;
+    if(size - tail_gap > pool_mgr->reserved_size - old_size) return ALLOC_FAIL;
+    size_t new_size = _mem_page_round(old_size + (size - tail_gap));
+    if(new_size > pool_mgr->reserved_size) return ALLOC_FAIL;
+    assert(new_size >= old_size);
+
+    // commit the pages between the old and the new top
+    size_t committed = _mem_page_round(old_size);
+    if(new_size > committed
+       && mprotect(pool_mgr->pool.mem + committed, new_size - committed,
+                   PROT_READ | PROT_WRITE) != 0) return ALLOC_FAIL;
+
+    alloc_status status;
+    if(tail_gap > 0) {
+        //   grow the trailing gap, re-indexing it under its new size
+        status = _mem_remove_from_gap_ix(pool_mgr, tail_gap, tail);
+        assert(status == ALLOC_OK);
+        tail->alloc_record.size += new_size - old_size;
+        tail->purged = 0;
+    } else {
+        //   append a new gap node after the last allocation
+        node_pt gap_node = _mem_get_unused_node(pool_mgr);
+        if(!gap_node) return ALLOC_FAIL;
+        gap_node->used = 1;
+        gap_node->allocated = 0;
+        gap_node->boundary = 0;
+        gap_node->deferred = 0;
+        gap_node->purged = 0;
+        gap_node->alloc_record.mem = pool_mgr->pool.mem + old_size;
+        gap_node->alloc_record.size = new_size - old_size;
+        gap_node->prev = tail;
+        gap_node->next = NULL;
+        tail->next = gap_node;
+        pool_mgr->tail = gap_node;
+        pool_mgr->used_nodes ++;
+        tail = gap_node;
+    }
+    pool_mgr->pool.total_size = new_size;
+
+    return _mem_add_to_gap_ix(pool_mgr, tail->alloc_record.size, tail);
+}
+
+static alloc_status _mem_add_extent(pool_mgr_pt pool_mgr, size_t size) {
+    // expand the extent array, if necessary (the first one is pool.mem)
+    if(pool_mgr->num_extents >= pool_mgr->extents_capacity) {
+        unsigned new_capacity = pool_mgr->extents_capacity
+                                ? pool_mgr->extents_capacity * MEM_EXPAND_FACTOR
+                                : MEM_EXTENTS_INIT_CAPACITY;
+        extent_pt new_extents =
+                (extent_pt)realloc(pool_mgr->extents, new_capacity * sizeof(extent_t));
+        if(!new_extents) return ALLOC_FAIL;
+        if(!pool_mgr->extents) {
+            new_extents[0].mem = pool_mgr->pool.mem;
+            new_extents[0].size = pool_mgr->pool.total_size;
+        }
+        pool_mgr->extents = new_extents;
+        pool_mgr->extents_capacity = new_capacity;
+    }
+
+    // grow the pool by (MEM_EXPAND_FACTOR - 1) times its size, or enough for size
+    size_t extent_size = pool_mgr->pool.total_size * (MEM_EXPAND_FACTOR - 1);
+    if(extent_size < size) extent_size = size;
+    char *mem = (char*)malloc(extent_size);
+    if(!mem) return ALLOC_FAIL;
+
+    node_pt gap_node = _mem_get_unused_node(pool_mgr);
+    if(!gap_node) {
+        free(mem);
+        return ALLOC_FAIL;
+    }
+
+    // append a gap node covering the extent to the end of the list
+    // note: the list is in address order only within each extent
+    gap_node->used = 1;
+    gap_node->allocated = 0;
+    gap_node->boundary = 1;
+    gap_node->deferred = 0;
+    gap_node->purged = 0;
+    gap_node->alloc_record.mem = mem;
+    gap_node->alloc_record.size = extent_size;
+    gap_node->prev = pool_mgr->tail;
+    gap_node->next = NULL;
+    pool_mgr->tail->next = gap_node;
+    pool_mgr->tail = gap_node;
+    pool_mgr->used_nodes ++;
+
+    pool_mgr->extents[pool_mgr->num_extents].mem = mem;
+    pool_mgr->extents[pool_mgr->num_extents].size = extent_size;
+    pool_mgr->num_extents ++;
+    pool_mgr->pool.total_size += extent_size;
+
+    return _mem_add_to_gap_ix(pool_mgr, extent_size, gap_node);
+}
+
+static alloc_status _mem_release_extent(pool_mgr_pt pool_mgr, node_pt node) {
+    size_t extent_size = node->alloc_record.size;
+
+    // find the extent (never the first one, which is pool.mem)
+    unsigned position = 0;
+    for(unsigned i = 1; i < pool_mgr->num_extents; ++i) {
+        if(pool_mgr->extents[i].mem == node->alloc_record.mem) {
+            position = i;
+            break;
+        }
+    }
+    if(position == 0) return ALLOC_FAIL;
+
+    alloc_status status = _mem_remove_from_gap_ix(pool_mgr, extent_size, node);
+    assert(status == ALLOC_OK);
+
+    // unlink the node and update metadata (used_nodes)
+    node->prev->next = node->next;
+    if(node->next) node->next->prev = node->prev;
+    else pool_mgr->tail = node->prev;
+    _mem_put_unused_node(pool_mgr, node);
+    pool_mgr->used_nodes --;
+
+    // free the extent and pull the later ones up
+    free(pool_mgr->extents[position].mem);
+    for(unsigned i = position; i < pool_mgr->num_extents - 1; ++i) {
+        pool_mgr->extents[i] = pool_mgr->extents[i + 1];
+    }
+    pool_mgr->num_extents --;
+    pool_mgr->pool.total_size -= extent_size;
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_purge_gap(pool_mgr_pt pool_mgr, node_pt node) {
+    // a gap that is still purged has no pages to give back
+    if(node->purged) return ALLOC_OK;
+
+    alloc_status status = _mem_purge_range(pool_mgr, node->alloc_record.mem,
+                                           node->alloc_record.size);
+    // note: after MADV_DONTNEED these pages read back as zero (fresh) on Linux
+    if(status == ALLOC_OK) node->purged = 1;
+
+    return status;
+}
+
+static alloc_status _mem_purge_range(pool_mgr_pt pool_mgr, char *mem, size_t size) {
+    // caller memory may be shared, so its pages are left alone
+    if(pool_mgr->caller_mem) return ALLOC_OK;
+
+    // only the whole pages inside the range can be released
+    size_t start = (size_t) mem;
+    size_t end = _mem_page_trunc(start + size);
+    start = _mem_page_round(start);
+    if(end > start
+       && madvise((void *) start, end - start, MADV_DONTNEED) != 0) return ALLOC_FAIL;
+
+    return ALLOC_OK;
+}
+
+static size_t _mem_page_round(size_t size) {
+    if(!mem_page_size) mem_page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    return (size + mem_page_size - 1) / mem_page_size * mem_page_size;
+}
+
+static size_t _mem_page_trunc(size_t size) {
+    if(!mem_page_size) mem_page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    return size / mem_page_size * mem_page_size;
+}
+
+#ifdef MEM_POOL_LATENCY
+static unsigned long _mem_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long) now.tv_sec * 1000000000UL + (unsigned long) now.tv_nsec;
+}
+
+static void _mem_record_latency(pool_mgr_pt pool_mgr, pool_op op, unsigned long nanos) {
+    // the pool's histogram (if any) and the process's take the same sample
+    // note: pools on other threads share the process's, so its counts are
+    // relaxed atomics (a reader may see a sample's count before its bucket)
+    unsigned bucket = _mem_latency_bucket(nanos);
+    shared_latency_hist_pt shared = &process_latency[op];
+    atomic_fetch_add_explicit(&shared->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shared->buckets[bucket], 1, memory_order_relaxed);
+    unsigned long max = atomic_load_explicit(&shared->max, memory_order_relaxed);
+    while(nanos > max
+          && !atomic_compare_exchange_weak_explicit(&shared->max, &max, nanos,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    if(!pool_mgr) return;
+    latency_hist_pt hist = &pool_mgr->latency[op];
+    hist->count ++;
+    hist->buckets[bucket] ++;
+    if(nanos > hist->max) hist->max = nanos;
+}
+
+static latency_hist_pt _mem_latency_hist(pool_mgr_pt pool_mgr, pool_op op, latency_hist_pt copy) {
+    // a pool's histogram as is, the process's copied out
+    if(pool_mgr) return &pool_mgr->latency[op];
+    shared_latency_hist_pt shared = &process_latency[op];
+    copy->count = atomic_load_explicit(&shared->count, memory_order_relaxed);
+    copy->max = atomic_load_explicit(&shared->max, memory_order_relaxed);
+    unsigned long seen = 0;
+    for(unsigned i = 0; i < MEM_LATENCY_BUCKETS; ++i) {
+        copy->buckets[i] = atomic_load_explicit(&shared->buckets[i], memory_order_relaxed);
+        seen += copy->buckets[i];
+    }
+    //   the percentiles rank within the buckets, so the count can't be ahead of them
+    if(copy->count > seen) copy->count = seen;
+
+    return copy;
+}
+
+static unsigned _mem_latency_bucket(unsigned long nanos) {
+    // below 2^SUB_BITS every value has its own bucket, above it each power
+    // of two is split into 2^SUB_BITS buckets by the bits after the top one
+    const unsigned long sub = 1UL << MEM_LATENCY_SUB_BITS;
+    if(nanos < sub) return (unsigned) nanos;
+    if(nanos >> MEM_LATENCY_MAX_BITS) return MEM_LATENCY_BUCKETS - 1;
+    unsigned top = 63 - __builtin_clzll((unsigned long long) nanos);
+    unsigned shift = top - MEM_LATENCY_SUB_BITS;
+
+    return ((shift + 1) << MEM_LATENCY_SUB_BITS) + (unsigned) ((nanos >> shift) - sub);
+}
+
+static unsigned long _mem_latency_bucket_max(unsigned bucket) {
+    // the highest value that falls into the bucket
+    const unsigned long sub = 1UL << MEM_LATENCY_SUB_BITS;
+    if(bucket < sub) return bucket;
+    unsigned shift = (bucket >> MEM_LATENCY_SUB_BITS) - 1;
+    unsigned long low = (sub + (bucket & (sub - 1))) << shift;
+
+    return low + (1UL << shift) - 1;
+}
+
+static unsigned long _mem_latency_percentile(latency_hist_pt hist, double percentile) {
+    // the bucket that the sample ranked percentile % of the way up falls into
+    // note: never more than the largest sample taken
+    double exact = percentile / 100.0 * hist->count;
+    unsigned long rank = (unsigned long) exact;
+    if(rank < exact || rank < 1) rank ++;
+    if(rank > hist->count) rank = hist->count;
+    unsigned long seen = 0;
+    for(unsigned i = 0; i < MEM_LATENCY_BUCKETS; ++i) {
+        seen += hist->buckets[i];
+        if(seen >= rank) {
+            unsigned long nanos = _mem_latency_bucket_max(i);
+            return nanos < hist->max ? nanos : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+#endif
+
+#ifdef MEM_POOL_PROFILE
+// note: not inlined, so the caller's frames start right after this one
+__attribute__((noinline))
+static void _mem_profile_alloc(pool_mgr_pt pool_mgr, char *mem, size_t size) {
+    // count down the bytes allocated, and sample the allocation that
+    // reaches 0, so that one is taken in about every profile_rate bytes
+    // note: only a sample takes the lock (two racing to 0 may both take one)
+    size_t rate = atomic_load_explicit(&profile_rate, memory_order_relaxed);
+    if(!rate || size == 0) return;
+    size_t countdown = atomic_load_explicit(&profile_countdown, memory_order_relaxed);
+    while(size < countdown) {
+        if(atomic_compare_exchange_weak_explicit(&profile_countdown, &countdown, countdown - size,
+                                                 memory_order_relaxed, memory_order_relaxed)) return;
+    }
+    pthread_mutex_lock(&profile_lock);
+    atomic_store_explicit(&profile_countdown, _mem_profile_interval(), memory_order_relaxed);
+
+    // expand the index, if necessary (the sample is skipped on error)
+    if(_mem_resize_profile_ix() != ALLOC_OK) {
+        pthread_mutex_unlock(&profile_lock);
+        return;
+    }
+
+    // an allocation smaller than the rate stands for the others not taken
+    unsigned mask = profile_ix_capacity - 1;
+    unsigned slot = _mem_hash_profile(mem);
+    while(profile_ix[slot].mem) slot = (slot + 1) & mask;
+    profile_sample_pt sample = &profile_ix[slot];
+    sample->mem = mem;
+    sample->pool_mgr = pool_mgr;
+    sample->size = size;
+    sample->weight = size < rate ? rate / size * size : size;
+    void *stack[MEM_PROFILE_DEPTH + 1];
+    int depth = backtrace(stack, MEM_PROFILE_DEPTH + 1);
+    sample->depth = depth > 1 ? (unsigned) depth - 1 : 0;
+    memcpy(sample->stack, stack + 1, sample->depth * sizeof(void *));
+    atomic_fetch_add_explicit(&profile_ix_size, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&profile_lock);
+}
+
+static void _mem_profile_free(char *mem) {
+    // most frees weren't sampled, and none are when there are no samples
+    if(!atomic_load_explicit(&profile_ix_size, memory_order_relaxed)) return;
+    pthread_mutex_lock(&profile_lock);
+    unsigned slot = profile_ix ? _mem_find_in_profile_ix(mem) : profile_ix_capacity;
+    if(slot != profile_ix_capacity) _mem_remove_from_profile_ix(slot);
+    pthread_mutex_unlock(&profile_lock);
+}
+
+static void _mem_profile_drop(pool_mgr_pt pool_mgr, char *from) {
+    // drop the pool's samples at or above from (all of them, if NULL)
+    // note: a removal can pull a later entry into the slot, so check it again
+    if(!atomic_load_explicit(&profile_ix_size, memory_order_relaxed)) return;
+    pthread_mutex_lock(&profile_lock);
+    for(unsigned i = 0; profile_ix_size && i < profile_ix_capacity; ) {
+        if(profile_ix[i].mem && profile_ix[i].pool_mgr == pool_mgr
+           && (!from || profile_ix[i].mem >= from)) {
+            _mem_remove_from_profile_ix(i);
+        } else {
+            ++i;
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+static alloc_status _mem_resize_profile_ix() {
+    // check if necessary (room for one more sample)
+    if(profile_ix
+       && ((float) (profile_ix_size + 1) / profile_ix_capacity)
+          <= MEM_PROFILE_IX_FILL_FACTOR) return ALLOC_OK;
+
+    unsigned new_capacity = profile_ix
+                            ? profile_ix_capacity * MEM_PROFILE_IX_EXPAND_FACTOR
+                            : MEM_PROFILE_IX_INIT_CAPACITY;
+    profile_sample_pt new_ix = (profile_sample_pt)calloc(new_capacity, sizeof(profile_sample_t));
+    if(!new_ix) return ALLOC_FAIL;
+
+    // the slots depend on the capacity, so re-insert the samples
+    profile_sample_pt old_ix = profile_ix;
+    unsigned old_capacity = profile_ix_capacity;
+    profile_ix = new_ix;
+    profile_ix_capacity = new_capacity;
+    for(unsigned i = 0; i < old_capacity; ++i) {
+        if(!old_ix[i].mem) continue;
+        unsigned slot = _mem_hash_profile(old_ix[i].mem);
+        while(new_ix[slot].mem) slot = (slot + 1) & (new_capacity - 1);
+        new_ix[slot] = old_ix[i];
+    }
+    free(old_ix);
+
+    return ALLOC_OK;
+}
+
+static unsigned _mem_find_in_profile_ix(const char *mem) {
+    // returns profile_ix_capacity if not found
+    unsigned mask = profile_ix_capacity - 1;
+    unsigned slot = _mem_hash_profile(mem);
+    while(profile_ix[slot].mem) {
+        if(profile_ix[slot].mem == mem) return slot;
+        slot = (slot + 1) & mask;
+    }
+
+    return profile_ix_capacity;
+}
+
+static void _mem_remove_from_profile_ix(unsigned slot) {
+    // pull later samples of the probe run back into the hole, as in
+    // _mem_remove_from_alloc_ix
+    unsigned mask = profile_ix_capacity - 1;
+    unsigned next = slot;
+    for(;;) {
+        next = (next + 1) & mask;
+        if(!profile_ix[next].mem) break;
+        unsigned home = _mem_hash_profile(profile_ix[next].mem);
+        // the sample stays if its home slot is cyclically in (slot, next]
+        if(slot <= next ? (slot < home && home <= next) : (slot < home || home <= next)) {
+            continue;
+        }
+        profile_ix[slot] = profile_ix[next];
+        slot = next;
+    }
+    profile_ix[slot].mem = NULL;
+    atomic_fetch_sub_explicit(&profile_ix_size, 1, memory_order_relaxed);
+}
+
+static unsigned _mem_hash_profile(const char *mem) {
+    // Fibonacci hashing of the address, the capacity is a power of two
+    unsigned long long hash = (unsigned long long) (size_t) mem * 11400714819323198485ull;
+
+    return (unsigned) (hash >> 32) & (profile_ix_capacity - 1);
+}
+
+static size_t _mem_profile_interval() {
+    // uniform in [1, 2 * profile_rate), so the mean is profile_rate, but
+    // allocation patterns that repeat with the rate aren't always missed
+    profile_random ^= profile_random << 13;
+    profile_random ^= profile_random >> 7;
+    profile_random ^= profile_random << 17;
+
+    size_t rate = atomic_load_explicit(&profile_rate, memory_order_relaxed);
+
+    return rate > 1 ? 1 + (size_t) (profile_random % (2 * rate - 1)) : 1;
+}
+
+static int _mem_compare_stacks(const void *a, const void *b) {
+    // orders samples by call stack, so that equal ones are adjacent
+    profile_sample_pt sample_a = *(const profile_sample_pt *) a;
+    profile_sample_pt sample_b = *(const profile_sample_pt *) b;
+    if(sample_a->depth != sample_b->depth) return sample_a->depth < sample_b->depth ? -1 : 1;
+
+    return memcmp(sample_a->stack, sample_b->stack, sample_a->depth * sizeof(void *));
+}
+#endif
+
+static alloc_status _mem_render(pool_mgr_pt pool_mgr, FILE *out, layout_format format,
+                                unsigned width, unsigned height, const char *title) {
+    size_t num_cells = (size_t) width * height;
+    if(!out || num_cells == 0 || num_cells > MEM_LAYOUT_MAX_CELLS) return ALLOC_FAIL;
+
+    // the segments, in walk order, cover the pool's bytes one after another
+    // (the extents of an expandable pool too)
+    pool_cursor_t cursor;
+    pool_record_t record;
+    size_t total_size = 0;
+    memset(&cursor, 0, sizeof(cursor));
+    while(mem_pool_walk((pool_pt) pool_mgr, &cursor, WALK_ALL, &record) == ALLOC_OK) total_size += record.size;
+
+    // every cell stands for as many bytes, rounded up, so the last ones may be past the end
+    size_t cell_size = total_size ? (total_size + num_cells - 1) / num_cells : 1;
+    layout_cell_pt cells = (layout_cell_pt)calloc(num_cells, sizeof(layout_cell_t));
+    if(!cells) return ALLOC_FAIL;
+
+    // spread each allocation over the cells it overlaps
+    size_t offset = 0;
+    memset(&cursor, 0, sizeof(cursor));
+    while(mem_pool_walk((pool_pt) pool_mgr, &cursor, WALK_ALL, &record) == ALLOC_OK) {
+        size_t end = offset + record.size;
+        for(size_t c = offset / cell_size; record.allocated && c * cell_size < end; ++c) {
+            size_t from = (c * cell_size > offset) ? c * cell_size : offset;
+            size_t to = ((c + 1) * cell_size < end) ? (c + 1) * cell_size : end;
+            cells[c].alloc_size += to - from;
+            if(record.size > cells[c].largest) cells[c].largest = record.size;
+        }
+        offset = end;
+    }
+
+    if(format == LAYOUT_PPM) {
+        // a binary PPM image, one pixel per cell: allocations in the color
+        // of their size class (dimmed if the cell is partly free), gaps dark
+        // grey and what is past the end black
+        fprintf(out, "P6\n");
+        if(title) fprintf(out, "# %s\n", title);
+        fprintf(out, "%u %u\n255\n", width, height);
+        for(size_t c = 0; c < num_cells; ++c) {
+            size_t capacity = (c * cell_size < total_size) ? total_size - c * cell_size : 0;
+            if(capacity > cell_size) capacity = cell_size;
+            unsigned char pixel[3] = { 48, 48, 48 };
+            if(capacity == 0) {
+                memset(pixel, 0, sizeof(pixel));
+            } else if(cells[c].alloc_size) {
+                memcpy(pixel, MEM_LAYOUT_RGB[_mem_layout_class(cells[c].largest)], sizeof(pixel));
+                if(cells[c].alloc_size < capacity) {
+                    for(unsigned i = 0; i < 3; ++i) pixel[i] /= 2;
+                }
+            }
+            fwrite(pixel, 1, sizeof(pixel), out);
+        }
+    } else {
+        // a map of ANSI colored characters, a row per line: # allocated,
+        // + partly allocated (in the color of the size class) and . free
+        if(title) fprintf(out, "%s\n", title);
+        fprintf(out, "%zu bytes, %u allocations, %u gaps, %zu bytes per cell\n",
+                total_size, pool_mgr->pool.num_allocs, pool_mgr->pool.num_gaps, cell_size);
+        for(unsigned row = 0; row < height; ++row) {
+            unsigned color = 0;
+            for(unsigned col = 0; col < width; ++col) {
+                size_t c = (size_t) row * width + col;
+                size_t capacity = (c * cell_size < total_size) ? total_size - c * cell_size : 0;
+                if(capacity > cell_size) capacity = cell_size;
+                unsigned cell_color = 0;
+                char glyph = ' ';
+                if(capacity && cells[c].alloc_size) {
+                    cell_color = MEM_LAYOUT_ANSI[_mem_layout_class(cells[c].largest)];
+                    glyph = (cells[c].alloc_size < capacity) ? '+' : '#';
+                } else if(capacity) {
+                    cell_color = 90;
+                    glyph = '.';
+                }
+                // switch colors only where they change
+                if(cell_color != color) fprintf(out, "\x1b[%um", cell_color);
+                color = cell_color;
+                fputc(glyph, out);
+            }
+            fprintf(out, "\x1b[0m\n");
+        }
+        fprintf(out, "# allocated, + partly, . free; sizes:");
+        for(unsigned i = 0; i < MEM_LAYOUT_CLASSES; ++i) {
+            fprintf(out, " \x1b[%um%s\x1b[0m", MEM_LAYOUT_ANSI[i], MEM_LAYOUT_LABELS[i]);
+        }
+        fprintf(out, "\n");
+    }
+    free(cells);
+
+    return ferror(out) ? ALLOC_FAIL : ALLOC_OK;
+}
+
+static unsigned _mem_layout_class(size_t size) {
+    // below 32 bytes, then a class for every factor of 4, up to the last
+    unsigned bucket = _mem_gap_bucket(size);
+    if(bucket < 5) return 0;
+    unsigned size_class = (bucket - 5) / 2 + 1;
+    return (size_class < MEM_LAYOUT_CLASSES) ? size_class : MEM_LAYOUT_CLASSES - 1;
+}
+
+#ifdef MEM_POOL_LAYOUT
+static void _mem_layout_tick(pool_mgr_pt pool_mgr) {
+    // count the operation, and render a frame if it's time
+    pool_mgr->layout_ops ++;
+    if(-- pool_mgr->layout_countdown) return;
+    pool_mgr->layout_countdown = pool_mgr->layout_every;
+
+    // ANSI frames move the cursor home first, so that playing them back in a
+    // terminal draws each over the last
+    // note: a frame that can't be written is skipped
+    char title[64];
+    snprintf(title, sizeof(title), "frame %lu, after %lu operations",
+             pool_mgr->layout_frames ++, pool_mgr->layout_ops);
+    if(pool_mgr->layout_fmt == LAYOUT_ANSI) fprintf(pool_mgr->layout_out, "\x1b[H");
+    _mem_render(pool_mgr, pool_mgr->layout_out, pool_mgr->layout_fmt,
+                pool_mgr->layout_width, pool_mgr->layout_height, title);
+}
+#endif
+
+static alloc_status _mem_report_start(report_format format, unsigned interval_ms) {
+    // note: the caller holds report_lock and has set the target
+    report_output_format = format;
+    report_interval_ms = interval_ms;
+    report_stopping = 0;
+    if(interval_ms == 0 || pthread_create(&report_thread, NULL, _mem_report_thread, NULL) != 0) {
+        free(report_path);
+        report_path = NULL;
+        report_fd = -1;
+        return ALLOC_FAIL;
+    }
+    report_running = 1;
+
+    return ALLOC_OK;
+}
+
+static void * _mem_report_thread(void *arg) {
+    (void) arg; /* unused */
+
+    // report, then sleep until the next one is due or the reporter is stopped
+    // note: the target is set before the thread starts and cleared after it
+    // is joined, so the report is written without report_lock, and
+    // mem_report_stop never waits for the lock behind a slow write
+    pthread_mutex_lock(&report_lock);
+    report_format format = report_output_format;
+    const char *path = report_path;
+    unsigned to_socket = report_to_socket;
+    int fd = report_fd;
+    while(!report_stopping) {
+        pthread_mutex_unlock(&report_lock);
+        _mem_report_once(format, path, to_socket, &fd);
+        pthread_mutex_lock(&report_lock);
+        //   a (re)connected socket is closed by mem_report_stop
+        report_fd = fd;
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += report_interval_ms / 1000;
+        deadline.tv_nsec += (long) (report_interval_ms % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec ++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while(!report_stopping
+              && pthread_cond_timedwait(&report_wakeup, &report_lock, &deadline) != ETIMEDOUT);
+    }
+    pthread_mutex_unlock(&report_lock);
+
+    return NULL;
+}
+
+static alloc_status _mem_report_once(report_format format, const char *path, unsigned to_socket, int *fd) {
+    // note: *fd is the caller's fd, or the connected socket (-1 if none)
+    char *buffer = NULL;
+    size_t size = 0;
+    if(_mem_format_report(format, &buffer, &size) != ALLOC_OK) return ALLOC_FAIL;
+
+    alloc_status status = ALLOC_FAIL;
+    if(path && !to_socket) {
+        // write a temporary file next to the report, then rename it over it
+        size_t path_len = strlen(path);
+        char *temp_path = (char *)malloc(path_len + sizeof(".tmp"));
+        if(temp_path) {
+            memcpy(temp_path, path, path_len);
+            memcpy(temp_path + path_len, ".tmp", sizeof(".tmp"));
+            int temp_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(temp_fd >= 0) {
+                status = _mem_write_all(temp_fd, buffer, size, 0);
+                if(close(temp_fd) != 0) status = ALLOC_FAIL;
+                if(status == ALLOC_OK && rename(temp_path, path) != 0) status = ALLOC_FAIL;
+                if(status != ALLOC_OK) unlink(temp_path);
+            }
+            free(temp_path);
+        }
+    } else if(path) {
+        // (re)connect to the socket, and drop the connection if it fails
+        // (a send that times out included)
+        if(*fd < 0) *fd = _mem_report_connect(path);
+        if(*fd >= 0) {
+            status = _mem_write_all(*fd, buffer, size, 1);
+            if(status != ALLOC_OK) {
+                close(*fd);
+                *fd = -1;
+            }
+        }
+    } else {
+        status = _mem_write_all(*fd, buffer, size, 0);
+    }
+    free(buffer);
+
+    return status;
+}
+
+static alloc_status _mem_format_report(report_format format, char **buffer, size_t *size) {
+    // copy the stats of the open pools, holding the store lock only for that
+    pthread_mutex_lock(&pool_store_lock);
+    unsigned num_entries = 0;
+    report_entry_pt entries = (report_entry_pt)malloc((pool_store_size + 1) * sizeof(report_entry_t));
+    if(!entries) {
+        pthread_mutex_unlock(&pool_store_lock);
+        return ALLOC_FAIL;
+    }
+    for(unsigned i = 0; i < pool_store_size; ++i) {
+        if(!pool_store[i]) continue;
+        entries[num_entries].slot = i;
+        _mem_snapshot_pool(pool_store[i], &entries[num_entries].stats, &entries[num_entries].policy);
+        num_entries ++;
+    }
+    pthread_mutex_unlock(&pool_store_lock);
+
+    // format the report in memory, so it's written out in one go
+    FILE *out = open_memstream(buffer, size);
+    if(!out) {
+        free(entries);
+        return ALLOC_FAIL;
+    }
+    _mem_print_report(out, format, entries, num_entries);
+    free(entries);
+    if(fclose(out) != 0) {
+        free(*buffer);
+        return ALLOC_FAIL;
+    }
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_write_all(int fd, const char *buffer, size_t size, int is_socket) {
+    // loop over short writes, and retry if interrupted
+    // note: a socket whose peer went away fails with EPIPE instead of SIGPIPE
+    while(size > 0) {
+        ssize_t written = is_socket ? send(fd, buffer, size, MSG_NOSIGNAL) : write(fd, buffer, size);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return ALLOC_FAIL;
+        }
+        buffer += written;
+        size -= (size_t) written;
+    }
+
+    return ALLOC_OK;
+}
+
+static int _mem_report_connect(const char *path) {
+    // returns -1 if nothing listens at the path (yet)
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    if(connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    // a listener that stops reading can't hold the reporter (and so
+    // mem_report_stop) up for longer than the timeout
+    struct timeval timeout;
+    timeout.tv_sec = MEM_REPORT_SEND_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (long) (MEM_REPORT_SEND_TIMEOUT_MS % 1000) * 1000L;
+    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void _mem_print_report(FILE *out,
+                              report_format format,
+                              report_entry_pt entries,
+                              unsigned num_entries) {
+    static const char *policy_names[] = { "FIRST_FIT", "BEST_FIT", "ARENA", "BITMAP" };
+
+    if(format == REPORT_JSON) {
+        // one line per report, so a stream of them is JSON lines
+        fprintf(out, "{\"pools\":[");
+        for(unsigned i = 0; i < num_entries; ++i) {
+            const pool_stats_t *stats = &entries[i].stats;
+            fprintf(out, "%s{\"pool\":%u,\"policy\":\"%s\",\"total_size\":%zu,\"alloc_size\":%zu,"
+                         "\"num_allocs\":%u,\"num_gaps\":%u,\"gap_size\":%zu,\"largest_gap\":%zu,"
+                         "\"mean_gap\":%zu,\"fragmentation\":%.6f,\"gap_histogram\":[",
+                    i ? "," : "", entries[i].slot, policy_names[entries[i].policy],
+                    stats->total_size, stats->alloc_size, stats->num_allocs, stats->num_gaps,
+                    stats->gap_size, stats->largest_gap, stats->mean_gap, stats->fragmentation);
+            for(unsigned b = 0; b < MEM_POOL_HISTOGRAM_BUCKETS; ++b) {
+                fprintf(out, "%s%u", b ? "," : "", stats->gap_histogram[b]);
+            }
+            fprintf(out, "]}");
+        }
+        fprintf(out, "]}\n");
+        return;
+    }
+
+    // Prometheus text: each metric's help and type, then a sample per pool
+    static const char *names[] = {
+        "mem_pool_total_size_bytes", "mem_pool_alloc_size_bytes", "mem_pool_allocs",
+        "mem_pool_gaps", "mem_pool_gap_size_bytes", "mem_pool_largest_gap_bytes",
+        "mem_pool_mean_gap_bytes", "mem_pool_fragmentation_ratio", "mem_pool_gaps_by_size"
+    };
+    static const char *helps[] = {
+        "Bytes of pool memory.", "Bytes allocated.", "Number of allocations.",
+        "Number of gaps.", "Free bytes, in all gaps.", "Bytes in the largest gap.",
+        "Mean bytes per gap.", "1 - largest gap / free bytes.",
+        "Number of gaps of 2^log2 to 2^(log2+1)-1 bytes."
+    };
+    static const unsigned num_metrics = sizeof(names) / sizeof(names[0]);
+    for(unsigned m = 0; m < num_metrics; ++m) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n", names[m], helps[m], names[m]);
+        for(unsigned i = 0; i < num_entries; ++i) {
+            const pool_stats_t *stats = &entries[i].stats;
+            const char *policy = policy_names[entries[i].policy];
+            double value = 0;
+            switch(m) {
+                case 0: value = (double) stats->total_size; break;
+                case 1: value = (double) stats->alloc_size; break;
+                case 2: value = stats->num_allocs; break;
+                case 3: value = stats->num_gaps; break;
+                case 4: value = (double) stats->gap_size; break;
+                case 5: value = (double) stats->largest_gap; break;
+                case 6: value = (double) stats->mean_gap; break;
+                case 7: value = stats->fragmentation; break;
+                default:
+                    // only the buckets that have gaps in them
+                    for(unsigned b = 0; b < MEM_POOL_HISTOGRAM_BUCKETS; ++b) {
+                        if(!stats->gap_histogram[b]) continue;
+                        fprintf(out, "%s{pool=\"%u\",policy=\"%s\",log2=\"%u\"} %u\n",
+                                names[m], entries[i].slot, policy, b, stats->gap_histogram[b]);
+                    }
+                    continue;
+            }
+            fprintf(out, "%s{pool=\"%u\",policy=\"%s\"} %.15g\n",
+                    names[m], entries[i].slot, policy, value);
+        }
+    }
+}
@@ -5,9 +5,11 @@
 #ifndef MEM_POOL_H
 #define MEM_POOL_H
 
+#include <stdio.h> // for FILE
+
 /* type declarations */
 
-typedef enum _alloc_policy { FIRST_FIT, BEST_FIT } alloc_policy;
+typedef enum _alloc_policy { FIRST_FIT, BEST_FIT, ARENA, BITMAP } alloc_policy;
 
 typedef struct _pool {
     char *mem;
@@ -16,6 +18,7 @@ typedef struct _pool {
     size_t alloc_size;
     unsigned num_allocs;
     unsigned num_gaps;
+    size_t largest_gap; // larger requests fail without a search (unless the pool grows)
 } pool_t, *pool_pt;
 
 typedef struct _pool_segment {
@@ -23,6 +26,65 @@ typedef struct _pool_segment {
     unsigned long allocated; // 1-allocation, 0-gap (note: 8 bytes)
 } pool_segment_t, *pool_segment_pt;
 
+typedef struct _pool_mark {
+    size_t top;
+    size_t last;
+    size_t alloc_size;
+    unsigned num_allocs;
+    unsigned long epoch; // tells a mark from one the arena has since rewound past
+} pool_mark_t;
+
+#define MEM_POOL_HISTOGRAM_BUCKETS 64
+
+typedef struct _pool_stats {
+    size_t total_size;
+    size_t alloc_size;
+    size_t gap_size; // free bytes, in all gaps together
+    size_t largest_gap;
+    size_t mean_gap; // 0 if there are no gaps
+    double fragmentation; // 1 - largest_gap / gap_size, 0 if there are no gaps
+    unsigned num_allocs;
+    unsigned num_gaps;
+    unsigned gap_histogram[MEM_POOL_HISTOGRAM_BUCKETS]; // [i]: gaps of 2^i to 2^(i+1)-1 bytes
+} pool_stats_t;
+
+typedef struct _pool_counters {
+    unsigned long allocs; // mem_new_alloc calls
+    unsigned long alloc_failures;
+    unsigned long frees; // mem_del_alloc calls
+    unsigned long free_failures;
+    unsigned long searches; // policy searches for a gap or free block
+    unsigned long nodes_visited; // FIRST_FIT: list nodes (tagged: blocks) looked at
+    unsigned long entries_examined; // BEST_FIT: gap index entries looked at
+    unsigned long splits; // gaps split by an allocation
+    unsigned long coalesces; // gaps merged with a neighbor
+    unsigned long node_heap_growths;
+    unsigned long gap_ix_growths;
+} pool_counters_t;
+
+typedef enum _pool_op { POOL_OP_ALLOC, POOL_OP_FREE, POOL_OP_OPEN, POOL_OP_CLOSE, POOL_OPS } pool_op;
+
+typedef enum _report_format { REPORT_PROMETHEUS, REPORT_JSON } report_format;
+
+typedef enum _layout_format { LAYOUT_ANSI, LAYOUT_PPM } layout_format;
+
+typedef enum _walk_filter { WALK_ALL, WALK_GAPS, WALK_ALLOCS } walk_filter;
+
+typedef struct _pool_record {
+    char *mem; // start of the segment (a tagged block starts with its header)
+    size_t size;
+    unsigned allocated : 1; // 1-allocation, 0-gap
+    unsigned purged : 1; // gaps: 1-whole pages inside were returned to the OS
+} pool_record_t, *pool_record_pt;
+
+typedef struct _pool_cursor {
+    char *next; // where the walk goes on from
+    size_t pos;
+    unsigned long generation;
+    unsigned started;
+    unsigned done;
+} pool_cursor_t; // a zeroed cursor starts at the first segment
+
 typedef enum _alloc_status {
     ALLOC_OK,
     ALLOC_FAIL,
@@ -41,6 +103,41 @@ mem_free();
 pool_pt
 mem_pool_open(size_t size, alloc_policy policy);
 
+// reserves reserve_size bytes of address space, but commits only size bytes;
+// the pool grows in place (total_size increases) as allocations reach the top
+pool_pt
+mem_pool_open_reserved(size_t size, size_t reserve_size, alloc_policy policy);
+
+// when no gap fits, the pool grows to MEM_EXPAND_FACTOR times its size (or
+// by enough for the allocation) with another extent; an extent left entirely
+// free is released on free, unless that fills the rest above MEM_FILL_FACTOR,
+// and by mem_pool_trim
+pool_pt
+mem_pool_open_expandable(size_t size, alloc_policy policy);
+
+// keeps each block's size and allocated flag in a header and footer inside
+// the pool memory, instead of in nodes; blocks are 16-byte aligned and carry
+// 24 bytes of tags, so fewer allocations fit (FIRST_FIT and BEST_FIT only);
+// the size is rounded down to whole 16-byte units, and no node heap or gap
+// index is allocated
+pool_pt
+mem_pool_open_tagged(size_t size, alloc_policy policy);
+
+// BITMAP pool with one bit per granule (a power of two) instead of nodes;
+// allocations take whole granules, the lowest run that fits, and alloc_size
+// counts them whole (mem_pool_open uses 64-byte granules)
+pool_pt
+mem_pool_open_bitmap(size_t size, size_t granule);
+
+// manages the caller's buffer as pool memory, which is never freed
+pool_pt
+mem_pool_open_in(void *buffer, size_t size, alloc_policy policy);
+
+// as mem_pool_open_in, but also carves the pool's metadata out of the buffer,
+// so opening the pool makes no heap allocations (total_size < size)
+pool_pt
+mem_pool_open_embedded(void *buffer, size_t size, alloc_policy policy);
+
 alloc_status
 mem_pool_close(pool_pt pool);
 
@@ -50,6 +147,137 @@ mem_new_alloc(pool_pt pool, size_t size);
 alloc_status
 mem_del_alloc(pool_pt pool, void *alloc);
 
+// as mem_del_alloc, with the size the allocation was made with; lets an
+// arena pop any allocation at its top, and is checked unless NDEBUG
+alloc_status
+mem_del_alloc_sized(pool_pt pool, void *alloc, size_t size);
+
+// frees all allocations at once, without walking them
+alloc_status
+mem_pool_reset(pool_pt pool);
+
+// ARENA only: remembers the bump pointer, so that a rewind to the mark
+// frees everything allocated after it at once; a mark can be rewound to
+// again and again, until the bump pointer goes below it (ALLOC_FAIL after)
+pool_mark_t
+mem_pool_mark(pool_pt pool);
+
+alloc_status
+mem_pool_rewind(pool_pt pool, pool_mark_t mark);
+
+// returns the whole pages inside gaps of at least min_gap bytes to the OS
+alloc_status
+mem_pool_purge(pool_pt pool, size_t min_gap);
+
+// purges every gap of at least min_gap bytes as it is freed (0 turns it off)
+alloc_status
+mem_pool_set_purge_threshold(pool_pt pool, size_t min_gap);
+
+// node pools only: defers coalescing until max_deferred frees (0 turns it
+// off); a deferred free is reused for the same size, or coalesced with the
+// others when an allocation misses (it isn't counted in num_gaps until then)
+alloc_status
+mem_pool_set_deferred(pool_pt pool, unsigned max_deferred);
+
+// node pools only: frees go on per-size quick lists, which allocations of
+// the same size check before the policy search; each list holds up to a cap
+// that adapts to demand, between 1 and max_per_size (0 turns it off); the
+// lists are flushed into gaps when the search misses
+alloc_status
+mem_pool_set_quick_lists(pool_pt pool, unsigned max_per_size);
+
+// releases the trailing gap of the pool: free trailing extents are given
+// back, a reservation is decommitted, otherwise the gap is purged
+alloc_status
+mem_pool_trim(pool_pt pool);
+
+// visits the segments one per call, in address order (within each extent),
+// without allocating; ALLOC_FAIL once there are no more; a cursor can be
+// copied and resumed later, at the segment containing its position if the
+// pool has changed since
+alloc_status
+mem_pool_walk(pool_pt pool, pool_cursor_t *cursor, walk_filter filter, pool_record_pt record);
+
+// fragmentation metrics, kept up to date as gaps come and go, so this is
+// O(1) however many segments the pool has (deferred frees aren't gaps yet)
+pool_stats_t
+mem_pool_stats(pool_pt pool);
+
+// the same, but safe to call from another thread while the pool's owner
+// changes it, e.g. for monitoring; the copy is consistent, not torn, and
+// the owner never waits for it (the pool has to stay open, though)
+alloc_status
+mem_pool_snapshot(pool_pt pool, pool_stats_t *stats);
+
+// the pool's operation counts since it was opened, if compiled with
+// MEM_POOL_COUNTERS (ALLOC_FAIL otherwise); the mean search length is
+// nodes_visited or entries_examined over searches
+alloc_status
+mem_pool_counters(pool_pt pool, pool_counters_t *counters);
+
+// the latency in nanoseconds that percentile % of the op's calls took at
+// most (to within an eighth), if compiled with MEM_POOL_LATENCY (ALLOC_FAIL
+// otherwise, or with no calls); a NULL pool gives the whole process, which
+// is the only one to count closes
+alloc_status
+mem_pool_latency(pool_pt pool, pool_op op, double percentile, unsigned long *nanos);
+
+// prints the count, p50, p90, p99, p99.9 and maximum of each op's latency
+alloc_status
+mem_pool_dump_latency(pool_pt pool, FILE *out);
+
+// samples an allocation in about every bytes allocated (0 turns it off,
+// mem_init sets 512KiB), keeping its call stack until it is freed, if
+// compiled with MEM_POOL_PROFILE (ALLOC_FAIL otherwise)
+alloc_status
+mem_pool_set_profile_rate(size_t bytes);
+
+// prints the estimated live objects and bytes of the pool (of every pool, if
+// NULL) per call stack, in pprof's legacy heap profile format
+alloc_status
+mem_pool_dump_profile(pool_pt pool, FILE *out);
+
+// draws the segments in address order (an expandable pool's extents one
+// after the other) on a width x height grid of cells, each standing for as
+// many bytes: as a map of ANSI colored characters, or as a binary PPM image
+// with a pixel per cell; a cell with allocations in it takes the color of
+// the largest one's size class
+alloc_status
+mem_pool_render(pool_pt pool, FILE *out, layout_format format, unsigned width, unsigned height);
+
+// a time-lapse: renders a frame to out after every every_ops allocations
+// and frees (0 stops), if compiled with MEM_POOL_LAYOUT (ALLOC_FAIL
+// otherwise); PPM frames follow each other, as ffmpeg's image2pipe reads
+// them, and ANSI frames start with a cursor home, to be played back with cat
+alloc_status
+mem_pool_record_layout(pool_pt pool, FILE *out, layout_format format,
+                       unsigned width, unsigned height, unsigned every_ops);
+
+// writes the stats of every open pool to fd, once, as Prometheus text or
+// as a line of JSON
+alloc_status
+mem_report_write(int fd, report_format format);
+
+// start a thread that writes the report every interval_ms, until stopped:
+// to the caller's fd (which is left open),
+alloc_status
+mem_report_start_fd(int fd, report_format format, unsigned interval_ms);
+
+// replacing the file at path (readers never see a partial report),
+alloc_status
+mem_report_start_file(const char *path, report_format format, unsigned interval_ms);
+
+// or to the Unix domain stream socket listening at path (reconnecting after errors);
+// note: the pools are locked against closing while their stats are copied,
+// with mem_pool_snapshot
+alloc_status
+mem_report_start_socket(const char *path, report_format format, unsigned interval_ms);
+
+// waits for the report being written, if any (a socket that stops reading
+// is dropped after a send timeout, but a caller's fd is waited on)
+alloc_status
+mem_report_stop();
+
 void
 mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments);
 #endif //C_MEM_POOL_H
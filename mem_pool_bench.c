@@ -0,0 +1,492 @@
+/*
+ * Microbenchmarks of the pool allocator, against the system malloc.
+ *
+ * Every run replays a trace of allocations and frees generated up front
+ * from a fixed seed, so the same build on the same machine does the same
+ * work each time; results go to stdout as one JSON document.
+ *
+ * usage: mem_pool_bench [--quick] [--seed N] [--repeat N]
+ */
+
+#define _DEFAULT_SOURCE // for clock_gettime() under -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mem_pool.h"
+
+/* type declarations */
+
+typedef enum _bench_kind { BENCH_FIRST_FIT, BENCH_BEST_FIT, BENCH_TAGGED_FIRST_FIT,
+                           BENCH_TAGGED_BEST_FIT, BENCH_BITMAP, BENCH_MALLOC, BENCH_KINDS } bench_kind;
+
+typedef struct _bench_op {
+    unsigned slot; // frees the slot's allocation if it has one, else allocates
+    unsigned size;
+} bench_op_t, *bench_op_pt;
+
+typedef struct _bench_trace {
+    bench_op_pt ops;
+    unsigned num_ops;
+    unsigned num_slots; // the most allocations live at once
+    unsigned num_warmup; // leading ops that only fill the slots, not timed
+} bench_trace_t, *bench_trace_pt;
+
+typedef struct _bench_result {
+    double ns_per_op; // median over the repeats
+    double min_ns_per_op;
+    unsigned long failures; // allocations that returned NULL
+} bench_result_t;
+
+/* constants */
+
+static const char *     BENCH_NAMES[BENCH_KINDS] = { "FIRST_FIT", "BEST_FIT", "TAGGED_FIRST_FIT",
+                                                     "TAGGED_BEST_FIT", "BITMAP", "malloc" };
+static const unsigned   BENCH_MIN_SIZE          = 16;
+static const unsigned   BENCH_MAX_SIZE          = 512;
+static const unsigned   BENCH_POOL_HEADROOM     = 4; // pool bytes per live byte, at most
+static const unsigned   BENCH_MAX_REPEAT        = 64;
+
+/* global options */
+
+static unsigned long bench_seed = 1;
+static unsigned bench_repeat = 5;
+static unsigned bench_quick = 0; // 1-smaller sweeps and traces, e.g. for a smoke run
+static unsigned bench_num_results = 0; // to separate the JSON results
+
+/* forward declarations */
+
+static unsigned long _bench_now_ns();
+static unsigned long _bench_random(unsigned long *state);
+static bench_trace_t _bench_make_trace(unsigned num_slots, unsigned num_ops);
+static pool_pt _bench_open(bench_kind kind, size_t size);
+static size_t _bench_pool_size(unsigned num_slots);
+static bench_result_t _bench_replay(bench_kind kind, bench_trace_pt trace, size_t pool_size);
+static unsigned long _bench_run(bench_kind kind, pool_pt pool, bench_trace_pt trace, void **slots,
+                                unsigned long *latencies, unsigned char *frees);
+static int _bench_compare(const void *a, const void *b);
+static double _bench_median(double *values, unsigned num_values);
+static void _bench_begin_result(const char *benchmark, bench_kind kind);
+
+static void _bench_throughput();
+static void _bench_latency();
+static void _bench_segment_sweep();
+static void _bench_pool_size_sweep();
+static void _bench_many_pools();
+
+
+/* main */
+int main(int argc, char *argv[]) {
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "--quick") == 0) {
+            bench_quick = 1;
+        } else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            bench_seed = strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            bench_repeat = (unsigned) strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: %s [--quick] [--seed N] [--repeat N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(bench_seed == 0) bench_seed = 1; // xorshift never leaves 0
+    if(bench_repeat == 0 || bench_repeat > BENCH_MAX_REPEAT) bench_repeat = 5;
+
+    if(mem_init() != ALLOC_OK) {
+        fprintf(stderr, "mem_init failed\n");
+        return 1;
+    }
+
+    // the build goes with the results, as the optional features cost time
+    printf("{\"benchmark\":\"mem_pool\",\"seed\":%lu,\"repeat\":%u,\"quick\":%s,",
+           bench_seed, bench_repeat, bench_quick ? "true" : "false");
+    printf("\"features\":[");
+    const char *separator = "";
+#ifdef MEM_POOL_COUNTERS
+    printf("%s\"MEM_POOL_COUNTERS\"", separator);
+    separator = ",";
+#endif
+#ifdef MEM_POOL_LATENCY
+    printf("%s\"MEM_POOL_LATENCY\"", separator);
+    separator = ",";
+#endif
+#ifdef MEM_POOL_PROBES
+    printf("%s\"MEM_POOL_PROBES\"", separator);
+    separator = ",";
+#endif
+#ifdef MEM_POOL_PROFILE
+    printf("%s\"MEM_POOL_PROFILE\"", separator);
+    separator = ",";
+#endif
+#ifdef MEM_POOL_LAYOUT
+    printf("%s\"MEM_POOL_LAYOUT\"", separator);
+    separator = ",";
+#endif
+    (void) separator;
+    printf("],\"results\":[\n");
+
+    _bench_throughput();
+    _bench_latency();
+    _bench_segment_sweep();
+    _bench_pool_size_sweep();
+    _bench_many_pools();
+
+    printf("\n]}\n");
+
+    return mem_free() == ALLOC_OK ? 0 : 1;
+}
+
+
+/* benchmarks */
+
+static void _bench_throughput() {
+    // random allocations and frees, with about half the slots live
+    unsigned num_slots = 1024;
+    bench_trace_t trace = _bench_make_trace(num_slots, bench_quick ? 20000 : 1000000);
+    size_t pool_size = _bench_pool_size(num_slots);
+
+    for(unsigned k = 0; k < BENCH_KINDS; ++k) {
+        bench_result_t result = _bench_replay((bench_kind) k, &trace, pool_size);
+        _bench_begin_result("throughput", (bench_kind) k);
+        printf(",\"slots\":%u,\"pool_size\":%zu,\"ops\":%u,\"ns_per_op\":%.2f,\"min_ns_per_op\":%.2f,"
+               "\"ops_per_sec\":%.0f,\"failures\":%lu}",
+               num_slots, pool_size, trace.num_ops - trace.num_warmup, result.ns_per_op,
+               result.min_ns_per_op, result.ns_per_op > 0 ? 1e9 / result.ns_per_op : 0.0, result.failures);
+    }
+    free(trace.ops);
+}
+
+static void _bench_latency() {
+    // the same kind of trace, timing every operation on its own
+    // note: each time includes reading the clock, timer_ns estimates that
+    unsigned num_slots = 1024;
+    bench_trace_t trace = _bench_make_trace(num_slots, bench_quick ? 20000 : 200000);
+    size_t pool_size = _bench_pool_size(num_slots);
+    unsigned num_timed = trace.num_ops - trace.num_warmup;
+    unsigned long *latencies = (unsigned long *)malloc(num_timed * sizeof(unsigned long));
+    unsigned long *sorted = (unsigned long *)malloc(num_timed * sizeof(unsigned long));
+    unsigned char *frees = (unsigned char *)malloc(num_timed);
+    void **slots = (void **)calloc(num_slots, sizeof(void *));
+    if(!latencies || !sorted || !frees || !slots) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    unsigned long timer_ns = ~0UL;
+    for(unsigned i = 0; i < 1000; ++i) {
+        unsigned long start = _bench_now_ns();
+        unsigned long elapsed = _bench_now_ns() - start;
+        if(elapsed < timer_ns) timer_ns = elapsed;
+    }
+
+    for(unsigned k = 0; k < BENCH_KINDS; ++k) {
+        pool_pt pool = _bench_open((bench_kind) k, pool_size);
+        if(k != BENCH_MALLOC && !pool) {
+            fprintf(stderr, "can't open a %s pool of %zu bytes\n", BENCH_NAMES[k], pool_size);
+            exit(1);
+        }
+        memset(slots, 0, num_slots * sizeof(void *));
+        unsigned long failures = _bench_run((bench_kind) k, pool, &trace, slots, latencies, frees);
+        for(unsigned s = 0; s < num_slots; ++s) {
+            if(slots[s] && pool) mem_del_alloc(pool, slots[s]);
+            else if(slots[s]) free(slots[s]);
+        }
+        if(pool) mem_pool_close(pool);
+
+        // allocations, then frees, sorted for the percentiles
+        const char *ops[2] = { "alloc", "free" };
+        for(unsigned o = 0; o < 2; ++o) {
+            unsigned n = 0;
+            for(unsigned i = 0; i < num_timed; ++i) {
+                if(frees[i] == o) sorted[n ++] = latencies[i];
+            }
+            qsort(sorted, n, sizeof(unsigned long), _bench_compare);
+            _bench_begin_result("latency", (bench_kind) k);
+            printf(",\"op\":\"%s\",\"slots\":%u,\"count\":%u,\"timer_ns\":%lu,\"failures\":%lu",
+                   ops[o], num_slots, n, timer_ns, failures);
+            if(n) {
+                printf(",\"p50_ns\":%lu,\"p90_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu",
+                       sorted[n / 2], sorted[(size_t) n * 9 / 10], sorted[(size_t) n * 99 / 100],
+                       sorted[(size_t) n * 999 / 1000], sorted[n - 1]);
+            }
+            printf("}");
+        }
+    }
+    free(slots);
+    free(frees);
+    free(sorted);
+    free(latencies);
+    free(trace.ops);
+}
+
+static void _bench_segment_sweep() {
+    // the number of live segments, which FIRST_FIT has to search through
+    unsigned max_slots = bench_quick ? 1024 : 16384;
+    for(unsigned num_slots = 16; num_slots <= max_slots; num_slots *= 4) {
+        bench_trace_t trace = _bench_make_trace(num_slots, bench_quick ? 10000 : 200000);
+        size_t pool_size = _bench_pool_size(num_slots);
+        bench_kind kinds[] = { BENCH_FIRST_FIT, BENCH_BEST_FIT, BENCH_BITMAP, BENCH_MALLOC };
+        for(unsigned k = 0; k < sizeof(kinds) / sizeof(kinds[0]); ++k) {
+            bench_result_t result = _bench_replay(kinds[k], &trace, pool_size);
+            _bench_begin_result("segments", kinds[k]);
+            printf(",\"slots\":%u,\"pool_size\":%zu,\"ns_per_op\":%.2f,\"min_ns_per_op\":%.2f,"
+                   "\"failures\":%lu}",
+                   num_slots, pool_size, result.ns_per_op, result.min_ns_per_op, result.failures);
+        }
+        free(trace.ops);
+    }
+}
+
+static void _bench_pool_size_sweep() {
+    // the same trace in ever larger pools: what opening and closing one
+    // costs, and whether the operations notice
+    unsigned num_slots = 256;
+    bench_trace_t trace = _bench_make_trace(num_slots, bench_quick ? 10000 : 200000);
+    size_t max_size = bench_quick ? (size_t) 1 << 22 : (size_t) 1 << 26;
+    for(size_t pool_size = _bench_pool_size(num_slots); pool_size <= max_size; pool_size *= 4) {
+        bench_kind kinds[] = { BENCH_FIRST_FIT, BENCH_BEST_FIT, BENCH_BITMAP };
+        for(unsigned k = 0; k < sizeof(kinds) / sizeof(kinds[0]); ++k) {
+            double open_ns[BENCH_MAX_REPEAT], close_ns[BENCH_MAX_REPEAT];
+            for(unsigned r = 0; r < bench_repeat; ++r) {
+                unsigned long start = _bench_now_ns();
+                pool_pt pool = _bench_open(kinds[k], pool_size);
+                unsigned long opened = _bench_now_ns();
+                if(pool) mem_pool_close(pool);
+                open_ns[r] = (double) (opened - start);
+                close_ns[r] = (double) (_bench_now_ns() - opened);
+            }
+            bench_result_t result = _bench_replay(kinds[k], &trace, pool_size);
+            _bench_begin_result("pool_size", kinds[k]);
+            printf(",\"slots\":%u,\"pool_size\":%zu,\"open_ns\":%.0f,\"close_ns\":%.0f,"
+                   "\"ns_per_op\":%.2f,\"failures\":%lu}",
+                   num_slots, pool_size, _bench_median(open_ns, bench_repeat),
+                   _bench_median(close_ns, bench_repeat), result.ns_per_op, result.failures);
+        }
+    }
+    free(trace.ops);
+}
+
+static void _bench_many_pools() {
+    // many small pools open at once, with the operations spread over them
+    // round robin (slot s belongs to pool s % num_pools)
+    unsigned max_pools = bench_quick ? 64 : 1024;
+    unsigned slots_per_pool = 32;
+    size_t pool_size = _bench_pool_size(slots_per_pool);
+    for(unsigned num_pools = 1; num_pools <= max_pools; num_pools *= 4) {
+        unsigned num_slots = num_pools * slots_per_pool;
+        bench_trace_t trace = _bench_make_trace(num_slots, bench_quick ? 10000 : 200000);
+        pool_pt *pools = (pool_pt *)calloc(num_pools, sizeof(pool_pt));
+        void **slots = (void **)calloc(num_slots, sizeof(void *));
+        if(!pools || !slots) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        bench_kind kinds[] = { BENCH_FIRST_FIT, BENCH_BEST_FIT, BENCH_MALLOC };
+        for(unsigned k = 0; k < sizeof(kinds) / sizeof(kinds[0]); ++k) {
+            double open_ns[BENCH_MAX_REPEAT], op_ns[BENCH_MAX_REPEAT], close_ns[BENCH_MAX_REPEAT];
+            unsigned long failures = 0;
+            for(unsigned r = 0; r < bench_repeat; ++r) {
+                unsigned long start = _bench_now_ns();
+                for(unsigned p = 0; p < num_pools; ++p) {
+                    pools[p] = _bench_open(kinds[k], pool_size);
+                    if(kinds[k] != BENCH_MALLOC && !pools[p]) {
+                        fprintf(stderr, "can't open %u %s pools\n", num_pools, BENCH_NAMES[kinds[k]]);
+                        exit(1);
+                    }
+                }
+                unsigned long opened = _bench_now_ns();
+
+                memset(slots, 0, num_slots * sizeof(void *));
+                unsigned long timed = 0;
+                for(unsigned i = 0; i < trace.num_ops; ++i) {
+                    if(i == trace.num_warmup) timed = _bench_now_ns();
+                    unsigned slot = trace.ops[i].slot;
+                    pool_pt pool = pools[slot % num_pools];
+                    if(slots[slot]) {
+                        if(pool) mem_del_alloc(pool, slots[slot]);
+                        else free(slots[slot]);
+                        slots[slot] = NULL;
+                    } else {
+                        slots[slot] = pool ? mem_new_alloc(pool, trace.ops[i].size) : malloc(trace.ops[i].size);
+                        if(!slots[slot]) failures ++;
+                    }
+                }
+                unsigned long done = _bench_now_ns();
+
+                // the pools go with their allocations
+                for(unsigned s = 0; s < num_slots; ++s) {
+                    if(slots[s] && !pools[s % num_pools]) free(slots[s]);
+                    else if(slots[s]) mem_del_alloc(pools[s % num_pools], slots[s]);
+                }
+                unsigned long freed = _bench_now_ns();
+                for(unsigned p = 0; p < num_pools; ++p) {
+                    if(pools[p]) mem_pool_close(pools[p]);
+                }
+                open_ns[r] = (double) (opened - start) / num_pools;
+                op_ns[r] = (double) (done - timed) / (trace.num_ops - trace.num_warmup);
+                close_ns[r] = (double) (_bench_now_ns() - freed) / num_pools;
+            }
+            _bench_begin_result("many_pools", kinds[k]);
+            printf(",\"pools\":%u,\"slots\":%u,\"pool_size\":%zu,\"open_ns\":%.0f,\"close_ns\":%.0f,"
+                   "\"ns_per_op\":%.2f,\"failures\":%lu}",
+                   num_pools, num_slots, pool_size, _bench_median(open_ns, bench_repeat),
+                   _bench_median(close_ns, bench_repeat), _bench_median(op_ns, bench_repeat),
+                   failures / bench_repeat);
+        }
+        free(pools);
+        free(slots);
+        free(trace.ops);
+    }
+}
+
+
+/* helpers */
+
+static unsigned long _bench_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long) now.tv_sec * 1000000000UL + (unsigned long) now.tv_nsec;
+}
+
+static unsigned long _bench_random(unsigned long *state) {
+    // xorshift64, so traces don't depend on the C library's rand()
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static bench_trace_t _bench_make_trace(unsigned num_slots, unsigned num_ops) {
+    // each op picks a random slot: a full one is freed, an empty one gets a
+    // new allocation of a random size, so about half the slots stay live;
+    // the warmup fills every other slot first
+    bench_trace_t trace;
+    unsigned long state = bench_seed;
+    trace.num_slots = num_slots;
+    trace.num_warmup = (num_slots + 1) / 2;
+    trace.num_ops = trace.num_warmup + num_ops;
+    trace.ops = (bench_op_pt)malloc(trace.num_ops * sizeof(bench_op_t));
+    if(!trace.ops) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for(unsigned i = 0; i < trace.num_ops; ++i) {
+        trace.ops[i].slot = (i < trace.num_warmup) ? 2 * i : (unsigned) (_bench_random(&state) % num_slots);
+        trace.ops[i].size = BENCH_MIN_SIZE
+                            + (unsigned) (_bench_random(&state) % (BENCH_MAX_SIZE - BENCH_MIN_SIZE + 1));
+    }
+
+    return trace;
+}
+
+static pool_pt _bench_open(bench_kind kind, size_t size) {
+    // NULL for malloc, which needs no pool
+    switch(kind) {
+        case BENCH_FIRST_FIT: return mem_pool_open(size, FIRST_FIT);
+        case BENCH_BEST_FIT: return mem_pool_open(size, BEST_FIT);
+        case BENCH_TAGGED_FIRST_FIT: return mem_pool_open_tagged(size, FIRST_FIT);
+        case BENCH_TAGGED_BEST_FIT: return mem_pool_open_tagged(size, BEST_FIT);
+        case BENCH_BITMAP: return mem_pool_open_bitmap(size, 16);
+        default: return NULL;
+    }
+}
+
+static size_t _bench_pool_size(unsigned num_slots) {
+    // room for every slot at the largest size, and then some for fragmentation
+    return (size_t) num_slots * BENCH_MAX_SIZE * BENCH_POOL_HEADROOM / 2;
+}
+
+static bench_result_t _bench_replay(bench_kind kind, bench_trace_pt trace, size_t pool_size) {
+    // replay the trace in a fresh pool each time, and keep the median
+    bench_result_t result = { 0.0, 0.0, 0 };
+    double ns_per_op[BENCH_MAX_REPEAT];
+    void **slots = (void **)calloc(trace->num_slots, sizeof(void *));
+    if(!slots) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    result.failures = 0;
+    for(unsigned r = 0; r < bench_repeat; ++r) {
+        pool_pt pool = _bench_open(kind, pool_size);
+        if(kind != BENCH_MALLOC && !pool) {
+            fprintf(stderr, "can't open a %s pool of %zu bytes\n", BENCH_NAMES[kind], pool_size);
+            exit(1);
+        }
+        memset(slots, 0, trace->num_slots * sizeof(void *));
+        unsigned long start = _bench_now_ns();
+        unsigned long failures = _bench_run(kind, pool, trace, slots, NULL, NULL);
+        unsigned long elapsed = _bench_now_ns() - start;
+        ns_per_op[r] = (double) elapsed / (trace->num_ops - trace->num_warmup);
+        if(r == 0 || ns_per_op[r] < result.min_ns_per_op) result.min_ns_per_op = ns_per_op[r];
+        result.failures = failures;
+
+        // clean up, untimed
+        for(unsigned s = 0; s < trace->num_slots; ++s) {
+            if(slots[s] && pool) mem_del_alloc(pool, slots[s]);
+            else if(slots[s]) free(slots[s]);
+        }
+        if(pool) mem_pool_close(pool);
+    }
+    free(slots);
+
+    result.ns_per_op = _bench_median(ns_per_op, bench_repeat);
+
+    return result;
+}
+
+static unsigned long _bench_run(bench_kind kind, pool_pt pool, bench_trace_pt trace, void **slots,
+                                unsigned long *latencies, unsigned char *frees) {
+    // the warmup isn't timed, latencies (if any) get one entry per timed op,
+    // and frees whether it was a free
+    // note: returns the failed allocations, and leaves the live ones in slots
+    unsigned long failures = 0;
+    unsigned long start = 0;
+    for(unsigned i = 0; i < trace->num_ops; ++i) {
+        unsigned slot = trace->ops[i].slot;
+        if(latencies && i >= trace->num_warmup) {
+            frees[i - trace->num_warmup] = slots[slot] != NULL;
+            start = _bench_now_ns();
+        }
+        if(slots[slot]) {
+            if(kind == BENCH_MALLOC) free(slots[slot]);
+            else mem_del_alloc(pool, slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = (kind == BENCH_MALLOC) ? malloc(trace->ops[i].size)
+                                                 : mem_new_alloc(pool, trace->ops[i].size);
+            if(!slots[slot]) failures ++;
+        }
+        if(latencies && i >= trace->num_warmup) latencies[i - trace->num_warmup] = _bench_now_ns() - start;
+    }
+
+    return failures;
+}
+
+static int _bench_compare(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *) a;
+    unsigned long y = *(const unsigned long *) b;
+    return (x > y) - (x < y);
+}
+
+static double _bench_median(double *values, unsigned num_values) {
+    // sorts the values in place
+    for(unsigned i = 1; i < num_values; ++i) {
+        double value = values[i];
+        unsigned j = i;
+        for(; j > 0 && values[j - 1] > value; --j) values[j] = values[j - 1];
+        values[j] = value;
+    }
+    return (num_values % 2) ? values[num_values / 2]
+                            : (values[num_values / 2 - 1] + values[num_values / 2]) / 2;
+}
+
+static void _bench_begin_result(const char *benchmark, bench_kind kind) {
+    // the caller adds its fields and the closing brace
+    printf("%s{\"name\":\"%s\",\"allocator\":\"%s\"", bench_num_results ++ ? ",\n" : "",
+           benchmark, BENCH_NAMES[kind]);
+}
@@ -2,12 +2,21 @@
 // Created by Ivo Georgiev on 3/3/16.
 //
 
+#define _DEFAULT_SOURCE // for usleep under -std=c11
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "cmocka.h"
 
 #include "mem_pool.h"
@@ -2393,7 +2402,1426 @@ void test_pool_stresstest0(void **state) {
 
 
 /*******************************************/
-/***         6. DRIVER ROUTINE           ***/
+/***          6. POOL VARIANTS           ***/
+/*******************************************/
+
+static void test_pool_reserved_growth(void **state) {
+    (void) state; /* unused */
+
+    const size_t reserve_size = 64 * POOL_SIZE;
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Reserving %lu bytes, committing 1000\n", (unsigned long) reserve_size);
+    pool = mem_pool_open_reserved(1000, reserve_size, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(pool->total_size, 1000);
+    char *mem = pool->mem;
+
+    void *alloc0 = mem_new_alloc(pool, 600);
+    assert_non_null(alloc0);
+
+    INFO("Allocating past the committed size\n");
+    void *alloc1 = mem_new_alloc(pool, POOL_SIZE);
+    assert_non_null(alloc1);
+    assert_true(pool->mem == mem);
+    assert_true(pool->total_size >= 600 + POOL_SIZE);
+    memset(alloc1, 0xab, POOL_SIZE);
+
+    INFO("Allocating past the reservation\n");
+    assert_null(mem_new_alloc(pool, reserve_size));
+
+    INFO("Allocating so much that the new size would wrap around\n");
+    size_t total_size = pool->total_size;
+    size_t alloc_size = pool->alloc_size;
+    assert_null(mem_new_alloc(pool, (size_t) -1 - 2000));
+    assert_int_equal(pool->total_size, total_size);
+    assert_int_equal(pool->alloc_size, alloc_size);
+    assert_int_equal(pool->num_allocs, 2);
+
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(pool->num_gaps, 1);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_expandable_extents(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating expandable pool of 1000 bytes\n");
+    pool = mem_pool_open_expandable(1000, FIRST_FIT);
+    assert_non_null(pool);
+
+    void *alloc0 = mem_new_alloc(pool, 800);
+    assert_non_null(alloc0);
+
+    INFO("Overflowing into a second and third extent\n");
+    void *alloc1 = mem_new_alloc(pool, 800);
+    assert_non_null(alloc1);
+    assert_int_equal(pool->total_size, 2000);
+    void *alloc2 = mem_new_alloc(pool, 3000);
+    assert_non_null(alloc2);
+    assert_int_equal(pool->total_size, 5000);
+
+    pool_segment_t exp0[5] =
+            {
+                    {800, 1},
+                    {200, 0},
+                    {800, 1},
+                    {200, 0},
+                    {3000, 1}
+            };
+    check_pool(pool, exp0);
+
+    INFO("Freeing the second extent, which is retained\n");
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    pool_segment_t exp1[4] =
+            {
+                    {800, 1},
+                    {200, 0},
+                    {1000, 0},
+                    {3000, 1}
+            };
+    check_pool(pool, exp1);
+    check_metadata(pool, FIRST_FIT, 5000, 3800, 2, 2);
+
+    INFO("Freeing the third extent, which is released\n");
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, 2000, 800, 1, 2);
+
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_purge(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    char *alloc0 = mem_new_alloc(pool, 100);
+    char *alloc1 = mem_new_alloc(pool, POOL_SIZE / 2);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    memset(alloc1, 0xff, POOL_SIZE / 2);
+
+    INFO("Purging gaps of at least 64K after a free\n");
+    assert_int_equal(mem_pool_set_purge_threshold(pool, 65536), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_pool_purge(pool, 65536), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 100, 1, 1);
+
+    INFO("Splitting the purged gap\n");
+    pool_cursor_t cursor;
+    pool_record_t record;
+    memset(&cursor, 0, sizeof(cursor));
+    assert_int_equal(mem_pool_walk(pool, &cursor, WALK_GAPS, &record), ALLOC_OK);
+    assert_int_equal(record.purged, 1);
+    char *alloc2 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc2);
+    memset(&cursor, 0, sizeof(cursor));
+    assert_int_equal(mem_pool_walk(pool, &cursor, WALK_GAPS, &record), ALLOC_OK);
+    // the remainder's whole pages are still purged
+    assert_ptr_equal(record.mem, alloc2 + 100);
+    assert_int_equal(record.purged, 1);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+
+#ifdef __linux__
+    // purged pages come back zero-filled
+    alloc1 = mem_new_alloc(pool, POOL_SIZE / 2);
+    assert_non_null(alloc1);
+    assert_int_equal(alloc1[POOL_SIZE / 4], 0);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+#endif
+
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_trim_and_shrink(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_allocations = 1000;
+    void *allocations[num_allocations];
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Growing and emptying the metadata of a reserved pool\n");
+    pool = mem_pool_open_reserved(1000, 64 * POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    for (unsigned aix=0; aix < num_allocations; ++aix) {
+        allocations[aix] = mem_new_alloc(pool, 1000);
+        assert_non_null(allocations[aix]);
+    }
+    assert_true(pool->total_size >= num_allocations * 1000);
+    for (unsigned aix=0; aix < num_allocations; aix += 2) {
+        assert_int_equal(mem_del_alloc(pool, allocations[aix]), ALLOC_OK);
+    }
+    assert_int_equal(pool->num_gaps, num_allocations / 2 + 1);
+    for (unsigned aix=1; aix < num_allocations; aix += 2) {
+        assert_int_equal(mem_del_alloc(pool, allocations[aix]), ALLOC_OK);
+    }
+    assert_int_equal(pool->num_gaps, 1);
+
+    INFO("Trimming the pool\n");
+    void *alloc = mem_new_alloc(pool, 100);
+    assert_non_null(alloc);
+    assert_int_equal(mem_pool_trim(pool), ALLOC_OK);
+    assert_true(pool->total_size < 1000 * 100);
+    check_metadata(pool, BEST_FIT, pool->total_size, 100, 1, 1);
+
+    INFO("Growing the trimmed pool again\n");
+    void *alloc1 = mem_new_alloc(pool, POOL_SIZE);
+    assert_non_null(alloc1);
+    memset(alloc1, 0, POOL_SIZE);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static char caller_buffer[1 << 16];
+
+static void test_pool_caller_memory(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_allocations = 100;
+    void *allocations[num_allocations];
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Opening pool over a static buffer\n");
+    pool = mem_pool_open_in(caller_buffer, sizeof(caller_buffer), BEST_FIT);
+    assert_non_null(pool);
+    assert_true(pool->mem == caller_buffer);
+    check_metadata(pool, BEST_FIT, sizeof(caller_buffer), 0, 0, 1);
+
+    void *alloc = mem_new_alloc(pool, 1000);
+    assert_true(alloc == caller_buffer);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    INFO("Opening pool with its metadata in a static buffer\n");
+    pool = mem_pool_open_embedded(caller_buffer, sizeof(caller_buffer), FIRST_FIT);
+    assert_non_null(pool);
+    assert_true((char *) pool >= caller_buffer);
+    assert_true((char *) pool < caller_buffer + sizeof(caller_buffer));
+    assert_true(pool->mem > (char *) pool);
+    assert_true(pool->total_size < sizeof(caller_buffer));
+
+    // enough to outgrow the embedded node heap and gap index
+    for (unsigned aix=0; aix < num_allocations; ++aix) {
+        allocations[aix] = mem_new_alloc(pool, 100);
+        assert_non_null(allocations[aix]);
+    }
+    for (unsigned aix=0; aix < num_allocations; aix += 2) {
+        assert_int_equal(mem_del_alloc(pool, allocations[aix]), ALLOC_OK);
+    }
+    for (unsigned aix=1; aix < num_allocations; aix += 2) {
+        assert_int_equal(mem_del_alloc(pool, allocations[aix]), ALLOC_OK);
+    }
+    check_metadata(pool, FIRST_FIT, pool->total_size, 0, 0, 1);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_many_small(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_pools = 1000;
+    pool_pt pools[num_pools];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Opening %u small pools\n", num_pools);
+    for (unsigned pix=0; pix < num_pools; ++pix) {
+        pools[pix] = mem_pool_open(100 + pix, (pix % 2) ? FIRST_FIT : BEST_FIT);
+        assert_non_null(pools[pix]);
+        assert_int_equal(pools[pix]->total_size, 100 + pix);
+        // the pool memory starts on its own cache line
+        assert_int_equal((unsigned long) pools[pix]->mem % 64, 0);
+        assert_non_null(mem_new_alloc(pools[pix], 100));
+    }
+    assert_int_equal(mem_free(), ALLOC_NOT_FREED);
+
+    INFO("Closing the pools\n");
+    for (unsigned pix=0; pix < num_pools; ++pix) {
+        assert_int_equal(mem_del_alloc(pools[pix], pools[pix]->mem), ALLOC_OK);
+        assert_int_equal(mem_pool_close(pools[pix]), ALLOC_OK);
+    }
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_arena(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating arena of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, ARENA);
+    assert_non_null(pool);
+
+    char *alloc0 = mem_new_alloc(pool, 100);
+    char *alloc1 = mem_new_alloc(pool, 200);
+    char *alloc2 = mem_new_alloc(pool, 300);
+    assert_true(alloc0 == pool->mem);
+    assert_true(alloc1 == alloc0 + 100);
+    assert_true(alloc2 == alloc1 + 200);
+    assert_null(mem_new_alloc(pool, POOL_SIZE));
+
+    pool_segment_t exp0[2] =
+            {
+                    {600, 1},
+                    {POOL_SIZE - 600, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, ARENA, POOL_SIZE, 600, 3, 1);
+
+    INFO("Freeing the most recent allocation only\n");
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    check_metadata(pool, ARENA, POOL_SIZE, 300, 2, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+
+    INFO("Resetting the arena\n");
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    check_metadata(pool, ARENA, POOL_SIZE, 0, 0, 1);
+    assert_true(mem_new_alloc(pool, 10) == pool->mem);
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    INFO("Resetting a best-fit pool\n");
+    pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    for (unsigned aix=0; aix < 100; ++aix) {
+        assert_non_null(mem_new_alloc(pool, 100));
+    }
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+    void *alloc = mem_new_alloc(pool, 100);
+    assert_true(alloc == pool->mem);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_arena_marks(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating arena of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, ARENA);
+    assert_non_null(pool);
+
+    assert_non_null(mem_new_alloc(pool, 100));
+    pool_mark_t mark0 = mem_pool_mark(pool);
+    assert_non_null(mem_new_alloc(pool, 200));
+    char *alloc1 = mem_new_alloc(pool, 300);
+    assert_non_null(alloc1);
+    pool_mark_t mark1 = mem_pool_mark(pool);
+    assert_non_null(mem_new_alloc(pool, 400));
+    assert_non_null(mem_new_alloc(pool, 500));
+    check_metadata(pool, ARENA, POOL_SIZE, 1500, 5, 1);
+
+    INFO("Rewinding to the inner mark\n");
+    assert_int_equal(mem_pool_rewind(pool, mark1), ALLOC_OK);
+    check_metadata(pool, ARENA, POOL_SIZE, 600, 3, 1);
+    // the allocation before the mark can still be popped
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    check_metadata(pool, ARENA, POOL_SIZE, 300, 2, 1);
+
+    INFO("Rewinding to the outer mark\n");
+    assert_int_equal(mem_pool_rewind(pool, mark0), ALLOC_OK);
+    check_metadata(pool, ARENA, POOL_SIZE, 100, 1, 1);
+    assert_int_equal(mem_pool_rewind(pool, mark1), ALLOC_FAIL);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_rewind(pool, mark0), ALLOC_FAIL);
+
+    INFO("Rewinding to a mark the bump pointer went below and back above\n");
+    mark0 = mem_pool_mark(pool);
+    assert_non_null(mem_new_alloc(pool, 100));
+    mark1 = mem_pool_mark(pool);
+    assert_int_equal(mem_pool_rewind(pool, mark0), ALLOC_OK);
+    assert_non_null(mem_new_alloc(pool, 100));
+    char *b = mem_new_alloc(pool, 100);
+    assert_non_null(b);
+    assert_non_null(mem_new_alloc(pool, 100));
+    assert_int_equal(mem_pool_rewind(pool, mark1), ALLOC_FAIL);
+    check_metadata(pool, ARENA, POOL_SIZE, 300, 3, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    memset(b, 0xAB, 100);
+
+    INFO("Rewinding to the same mark again and again\n");
+    for(int i = 0; i < 3; ++i) {
+        assert_int_equal(mem_pool_rewind(pool, mark0), ALLOC_OK);
+        check_metadata(pool, ARENA, POOL_SIZE, 0, 0, 1);
+        assert_non_null(mem_new_alloc(pool, 200));
+        assert_non_null(mem_new_alloc(pool, 300));
+    }
+    assert_int_equal(mem_pool_rewind(pool, mark0), ALLOC_OK);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_sized_free(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    void *alloc0 = mem_new_alloc(pool, 100);
+    void *alloc1 = mem_new_alloc(pool, 200);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+
+#ifndef NDEBUG
+    INFO("Freeing with the wrong size\n");
+    assert_int_equal(mem_del_alloc_sized(pool, alloc0, 200), ALLOC_FAIL);
+#endif
+    assert_int_equal(mem_del_alloc_sized(pool, alloc0, 100), ALLOC_OK);
+    assert_int_equal(mem_del_alloc_sized(pool, alloc0, 100), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc_sized(pool, alloc1, 200), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    INFO("Popping arena allocations by size\n");
+    pool = mem_pool_open(POOL_SIZE, ARENA);
+    assert_non_null(pool);
+    alloc0 = mem_new_alloc(pool, 100);
+    alloc1 = mem_new_alloc(pool, 200);
+    assert_int_equal(mem_del_alloc_sized(pool, alloc0, 100), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc_sized(pool, alloc1, 200), ALLOC_OK);
+    assert_int_equal(mem_del_alloc_sized(pool, alloc0, 100), ALLOC_OK);
+    check_metadata(pool, ARENA, POOL_SIZE, 0, 0, 1);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_tagged(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating tagged pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open_tagged(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    assert_null(mem_pool_open_tagged(16, BEST_FIT));
+    assert_null(mem_pool_open_tagged(POOL_SIZE, ARENA));
+
+    INFO("Blocks are aligned and carry their tags\n");
+    char *alloc0 = (char *) mem_new_alloc(pool, 100);
+    char *alloc1 = (char *) mem_new_alloc(pool, 10);
+    char *alloc2 = (char *) mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_non_null(alloc2);
+    assert_int_equal((size_t) alloc0 % 16, 0);
+    assert_int_equal(alloc1 - alloc0, 128);
+    assert_int_equal(alloc2 - alloc1, 48);
+    memset(alloc0, 0xff, 100);
+    memset(alloc1, 0xff, 10);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 210, 3, 1);
+
+    INFO("Freeing coalesces with both neighbors\n");
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 110, 2, 2);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, alloc0 + 16), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_FAIL);
+    pool_segment_t exp0[3] = {
+            {176, 0},
+            {128, 1},
+            {POOL_SIZE - 304, 0}
+    };
+    check_pool(pool, exp0);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 100, 1, 2);
+
+    INFO("Best fit takes the smaller gap\n");
+    void *alloc3 = mem_new_alloc(pool, 20);
+    assert_ptr_equal(alloc3, alloc0);
+    pool_segment_t exp1[4] = {
+            {48, 1},
+            {128, 0},
+            {128, 1},
+            {POOL_SIZE - 304, 0}
+    };
+    check_pool(pool, exp1);
+
+#ifndef NDEBUG
+    assert_int_equal(mem_del_alloc_sized(pool, alloc3, 100), ALLOC_FAIL);
+#endif
+    assert_int_equal(mem_del_alloc_sized(pool, alloc3, 20), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+
+    INFO("Filling the pool with small blocks, then resetting it\n");
+    unsigned num_allocs = 0;
+    while(mem_new_alloc(pool, 8)) num_allocs ++;
+    assert_int_equal(num_allocs, POOL_SIZE / 32);
+    assert_int_equal(pool->num_gaps, 0);
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+    assert_int_equal(mem_pool_purge(pool, 0), ALLOC_OK);
+    assert_int_equal(mem_pool_trim(pool), ALLOC_OK);
+
+    INFO("The size is rounded down to whole alignment units\n");
+    pool_pt odd_pool = mem_pool_open_tagged(POOL_SIZE + 8, FIRST_FIT);
+    assert_non_null(odd_pool);
+    check_metadata(odd_pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+    void *odd_alloc = mem_new_alloc(odd_pool, POOL_SIZE - 32);
+    assert_non_null(odd_alloc);
+    assert_null(mem_new_alloc(odd_pool, 8));
+    assert_int_equal(mem_del_alloc(odd_pool, odd_alloc), ALLOC_OK);
+    assert_int_equal(mem_pool_close(odd_pool), ALLOC_OK);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_bitmap(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating bitmap pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, BITMAP);
+    assert_non_null(pool);
+    check_metadata(pool, BITMAP, POOL_SIZE, 0, 0, 1);
+    assert_null(mem_pool_open_bitmap(POOL_SIZE, 48));
+    assert_null(mem_pool_open_expandable(POOL_SIZE, BITMAP));
+
+    INFO("Allocations take whole granules\n");
+    char *alloc0 = (char *) mem_new_alloc(pool, 100);
+    char *alloc1 = (char *) mem_new_alloc(pool, 64);
+    char *alloc2 = (char *) mem_new_alloc(pool, 1);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_non_null(alloc2);
+    assert_int_equal(alloc1 - alloc0, 128);
+    assert_int_equal(alloc2 - alloc1, 64);
+    check_metadata(pool, BITMAP, POOL_SIZE, 256, 3, 1);
+
+    INFO("Freeing clears the bits, next to allocated ones\n");
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, alloc0 + 64), ALLOC_FAIL);
+    pool_segment_t exp0[4] = {
+            {128, 1},
+            {64, 0},
+            {64, 1},
+            {POOL_SIZE - 256, 0}
+    };
+    check_pool(pool, exp0);
+    check_metadata(pool, BITMAP, POOL_SIZE, 192, 2, 2);
+
+    INFO("The lowest run that fits is taken\n");
+    assert_ptr_equal(mem_new_alloc(pool, 200), alloc2 + 64);
+    assert_ptr_equal(mem_new_alloc(pool, 10), alloc1);
+    check_metadata(pool, BITMAP, POOL_SIZE, 512, 4, 1);
+#ifndef NDEBUG
+    assert_int_equal(mem_del_alloc_sized(pool, alloc0, 64), ALLOC_FAIL);
+#endif
+    assert_int_equal(mem_del_alloc_sized(pool, alloc0, 128), ALLOC_OK);
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    check_metadata(pool, BITMAP, POOL_SIZE, 0, 0, 1);
+
+    INFO("Filling the pool granule by granule\n");
+    unsigned num_allocs = 0;
+    void *first = NULL;
+    void *alloc = NULL;
+    while((alloc = mem_new_alloc(pool, 64))) {
+        if(!first) first = alloc;
+        num_allocs ++;
+    }
+    assert_int_equal(num_allocs, POOL_SIZE / 64);
+    assert_int_equal(pool->num_gaps, 0);
+    assert_int_equal(mem_del_alloc(pool, (char *) first + 64 * 5000), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, (char *) first + 64 * 5001), ALLOC_OK);
+    assert_ptr_equal(mem_new_alloc(pool, 128), (char *) first + 64 * 5000);
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_purge(pool, 0), ALLOC_OK);
+    assert_int_equal(mem_pool_trim(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    INFO("Opening with 4 KiB granules\n");
+    pool = mem_pool_open_bitmap(POOL_SIZE, 4096);
+    assert_non_null(pool);
+    check_metadata(pool, BITMAP, POOL_SIZE / 4096 * 4096, 0, 0, 1);
+    assert_non_null(mem_new_alloc(pool, 100000));
+    check_metadata(pool, BITMAP, POOL_SIZE / 4096 * 4096, 25 * 4096, 1, 1);
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_largest_gap(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(pool->largest_gap, POOL_SIZE);
+
+    INFO("Tracking the largest gap through allocations and frees\n");
+    void *alloc0 = mem_new_alloc(pool, 1000);
+    void *alloc1 = mem_new_alloc(pool, 2000);
+    void *alloc2 = mem_new_alloc(pool, POOL_SIZE - 3000);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_non_null(alloc2);
+    assert_int_equal(pool->largest_gap, 0);
+    assert_null(mem_new_alloc(pool, 1));
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(pool->largest_gap, 2000);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(pool->largest_gap, 3000);
+
+    INFO("Rejecting a request larger than the largest gap\n");
+    assert_null(mem_new_alloc(pool, 3001));
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, POOL_SIZE - 3000, 1, 1);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(pool->largest_gap, POOL_SIZE);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    INFO("Tracking it in an arena\n");
+    pool = mem_pool_open(POOL_SIZE, ARENA);
+    assert_non_null(pool);
+    alloc0 = mem_new_alloc(pool, 1000);
+    assert_int_equal(pool->largest_gap, POOL_SIZE - 1000);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(pool->largest_gap, POOL_SIZE);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_deferred(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_set_deferred(pool, 4), ALLOC_OK);
+
+    void *alloc0 = mem_new_alloc(pool, 100);
+    void *alloc1 = mem_new_alloc(pool, 200);
+    void *alloc2 = mem_new_alloc(pool, 300);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_non_null(alloc2);
+
+    INFO("Deferred frees are left as they are\n");
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_FAIL);
+    pool_segment_t exp0[4] = {
+            {100, 0},
+            {200, 0},
+            {300, 1},
+            {POOL_SIZE - 600, 0}
+    };
+    check_pool(pool, exp0);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 300, 1, 1);
+
+    INFO("and reused for the same size\n");
+    assert_ptr_equal(mem_new_alloc(pool, 200), alloc1);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+
+    INFO("A miss coalesces them\n");
+    void *alloc3 = mem_new_alloc(pool, POOL_SIZE - 600 + 1);
+    assert_null(alloc3);
+    pool_segment_t exp1[3] = {
+            {300, 0},
+            {300, 1},
+            {POOL_SIZE - 600, 0}
+    };
+    check_pool(pool, exp1);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 300, 1, 2);
+
+    INFO("So does reaching the limit\n");
+    void *allocs[4];
+    for(unsigned i = 0; i < 4; ++i) {
+        allocs[i] = mem_new_alloc(pool, 50);
+        assert_non_null(allocs[i]);
+    }
+    for(unsigned i = 0; i < 4; ++i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    check_pool(pool, exp1);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+
+    INFO("Turning it off coalesces the rest\n");
+    assert_int_equal(mem_pool_set_deferred(pool, 0), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_free_burst(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+    void *allocs[100];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    for(unsigned i = 0; i < 100; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100 + i % 10);
+        assert_non_null(allocs[i]);
+    }
+
+    INFO("Freeing every other allocation in a row\n");
+    for(unsigned i = 0; i < 100; i += 2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+        assert_int_equal(pool->num_gaps, i / 2 + 2);
+    }
+    assert_int_equal(pool->largest_gap, POOL_SIZE - 50 * 209);
+
+    INFO("Best fit still takes the smallest, lowest gap\n");
+    assert_ptr_equal(mem_new_alloc(pool, 101), allocs[2]);
+    assert_ptr_equal(mem_new_alloc(pool, 100), allocs[0]);
+    assert_ptr_equal(mem_new_alloc(pool, 101), allocs[12]);
+
+    INFO("Freeing everything in a row\n");
+    for(unsigned i = 1; i < 100; i += 2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[12]), ALLOC_OK);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+    assert_int_equal(pool->largest_gap, POOL_SIZE);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_quick_lists(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+    void *allocs[8];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_set_quick_lists(pool, 8), ALLOC_OK);
+    for(unsigned i = 0; i < 8; ++i) {
+        allocs[i] = mem_new_alloc(pool, 64);
+        assert_non_null(allocs[i]);
+    }
+    void *alloc = mem_new_alloc(pool, 1000);
+    assert_non_null(alloc);
+
+    INFO("Frees of a size go on its list, up to its cap\n");
+    for(unsigned i = 0; i < 8; ++i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    // the first four are listed, the rest coalesce into a gap
+    pool_segment_t exp0[7] = {
+            {64, 0},
+            {64, 0},
+            {64, 0},
+            {64, 0},
+            {256, 0},
+            {1000, 1},
+            {POOL_SIZE - 1512, 0}
+    };
+    check_pool(pool, exp0);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 1000, 1, 2);
+
+    INFO("and are reused last in, first out\n");
+    assert_ptr_equal(mem_new_alloc(pool, 64), allocs[3]);
+    assert_ptr_equal(mem_new_alloc(pool, 64), allocs[2]);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_ptr_equal(mem_new_alloc(pool, 64), allocs[2]);
+
+    INFO("A search miss flushes them into gaps\n");
+    assert_null(mem_new_alloc(pool, POOL_SIZE));
+    pool_segment_t exp1[6] = {
+            {128, 0},
+            {64, 1},
+            {64, 1},
+            {256, 0},
+            {1000, 1},
+            {POOL_SIZE - 1512, 0}
+    };
+    check_pool(pool, exp1);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 1128, 3, 3);
+
+    INFO("Turning them off\n");
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_pool_set_quick_lists(pool, 0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_walk(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+    pool_cursor_t cursor;
+    pool_record_t record;
+    void *allocs[5];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    for(unsigned i = 0; i < 5; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100 * (i + 1));
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK);
+
+    INFO("Walking all segments\n");
+    memset(&cursor, 0, sizeof(cursor));
+    unsigned num_segments = 0;
+    char *end = pool->mem;
+    while(mem_pool_walk(pool, &cursor, WALK_ALL, &record) == ALLOC_OK) {
+        assert_ptr_equal(record.mem, end);
+        end += record.size;
+        num_segments ++;
+    }
+    assert_int_equal(num_segments, 6);
+    assert_ptr_equal(end, pool->mem + POOL_SIZE);
+    assert_int_equal(mem_pool_walk(pool, &cursor, WALK_ALL, &record), ALLOC_FAIL);
+
+    INFO("Walking the gaps only\n");
+    memset(&cursor, 0, sizeof(cursor));
+    assert_int_equal(mem_pool_walk(pool, &cursor, WALK_GAPS, &record), ALLOC_OK);
+    assert_ptr_equal(record.mem, allocs[1]);
+    assert_int_equal(record.size, 200);
+    assert_int_equal(record.allocated, 0);
+
+    INFO("Resuming after the pool changed\n");
+    pool_cursor_t saved = cursor;
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_pool_walk(pool, &saved, WALK_ALL, &record), ALLOC_OK);
+    assert_ptr_equal(record.mem, allocs[1]);
+    assert_int_equal(record.size, 900);
+    assert_int_equal(mem_pool_walk(pool, &saved, WALK_ALLOCS, &record), ALLOC_OK);
+    assert_ptr_equal(record.mem, allocs[4]);
+    assert_int_equal(record.size, 500);
+    assert_int_equal(record.allocated, 1);
+    assert_int_equal(mem_pool_walk(pool, &saved, WALK_ALLOCS, &record), ALLOC_FAIL);
+
+    for(unsigned i = 0; i < 5; i += 4) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_stats(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+    pool_stats_t stats;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    stats = mem_pool_stats(pool);
+    assert_int_equal(stats.gap_size, POOL_SIZE);
+    assert_int_equal(stats.mean_gap, POOL_SIZE);
+    assert_true(stats.fragmentation == 0.0);
+
+    INFO("Leaving two gaps of 1000 and 2000 bytes\n");
+    void *alloc0 = mem_new_alloc(pool, 1000);
+    void *alloc1 = mem_new_alloc(pool, 100);
+    void *alloc2 = mem_new_alloc(pool, 2000);
+    void *alloc3 = mem_new_alloc(pool, POOL_SIZE - 3100);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_non_null(alloc2);
+    assert_non_null(alloc3);
+    stats = mem_pool_stats(pool);
+    assert_int_equal(stats.gap_size, 0);
+    assert_int_equal(stats.num_gaps, 0);
+    assert_true(stats.fragmentation == 0.0);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    stats = mem_pool_stats(pool);
+    assert_int_equal(stats.gap_size, 3000);
+    assert_int_equal(stats.largest_gap, 2000);
+    assert_int_equal(stats.mean_gap, 1500);
+    assert_int_equal(stats.num_gaps, 2);
+    assert_int_equal(stats.gap_histogram[9], 1);
+    assert_int_equal(stats.gap_histogram[10], 1);
+    assert_true(stats.fragmentation > 0.33 && stats.fragmentation < 0.34);
+
+    INFO("Merging them into one\n");
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    stats = mem_pool_stats(pool);
+    assert_int_equal(stats.gap_size, 3100);
+    assert_int_equal(stats.gap_histogram[9], 0);
+    assert_int_equal(stats.gap_histogram[10], 0);
+    assert_int_equal(stats.gap_histogram[11], 1);
+    assert_true(stats.fragmentation == 0.0);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+    stats = mem_pool_stats(pool);
+    assert_int_equal(stats.gap_size, POOL_SIZE);
+    assert_int_equal(stats.num_gaps, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    INFO("Reporting the gap above an arena's bump pointer\n");
+    pool = mem_pool_open(POOL_SIZE, ARENA);
+    assert_non_null(pool);
+    alloc0 = mem_new_alloc(pool, 1000);
+    assert_non_null(alloc0);
+    stats = mem_pool_stats(pool);
+    assert_int_equal(stats.gap_size, POOL_SIZE - 1000);
+    assert_int_equal(stats.alloc_size, 1000);
+    assert_int_equal(stats.num_allocs, 1);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_counters(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+    pool_counters_t counters;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    INFO("Counting allocations, frees, splits and coalesces\n");
+    void *alloc0 = mem_new_alloc(pool, 1000);
+    void *alloc1 = mem_new_alloc(pool, 1000);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_null(mem_new_alloc(pool, POOL_SIZE));
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+#ifdef MEM_POOL_COUNTERS
+    assert_int_equal(mem_pool_counters(pool, &counters), ALLOC_OK);
+    assert_int_equal(counters.allocs, 3);
+    assert_int_equal(counters.alloc_failures, 1);
+    assert_int_equal(counters.frees, 3);
+    assert_int_equal(counters.free_failures, 1);
+    assert_int_equal(counters.searches, 2);
+    assert_int_equal(counters.nodes_visited, 3);
+    assert_int_equal(counters.splits, 2);
+    assert_int_equal(counters.coalesces, 2);
+#else
+    INFO("Counters are compiled out\n");
+    assert_int_equal(mem_pool_counters(pool, &counters), ALLOC_FAIL);
+    assert_int_equal(counters.allocs, 0);
+#endif
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+#ifdef MEM_POOL_COUNTERS
+    INFO("Counting gap index entries in a best-fit search\n");
+    pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    alloc0 = mem_new_alloc(pool, 100);
+    alloc1 = mem_new_alloc(pool, 100);
+    void *alloc2 = mem_new_alloc(pool, 100);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    void *alloc3 = mem_new_alloc(pool, 200);
+    assert_int_equal(mem_pool_counters(pool, &counters), ALLOC_OK);
+    assert_int_equal(counters.searches, 4);
+    // one entry for each of the first three searches, two for the last
+    assert_int_equal(counters.entries_examined, 5);
+    assert_int_equal(counters.nodes_visited, 0);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    INFO("Counting frees by size from an arena\n");
+    pool = mem_pool_open(POOL_SIZE, ARENA);
+    assert_non_null(pool);
+    alloc0 = mem_new_alloc(pool, 4096);
+    assert_non_null(alloc0);
+    assert_int_equal(mem_del_alloc_sized(pool, alloc0, 100), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc_sized(pool, alloc0, 4096), ALLOC_OK);
+    assert_int_equal(mem_pool_counters(pool, &counters), ALLOC_OK);
+    assert_int_equal(counters.allocs, 1);
+    assert_int_equal(counters.frees, 2);
+    assert_int_equal(counters.free_failures, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+#endif
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_latency(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+    unsigned long nanos = 0;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    INFO("Timing allocations and frees\n");
+    void *allocs[100];
+    for(unsigned i = 0; i < 100; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    for(unsigned i = 0; i < 100; ++i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+#ifdef MEM_POOL_LATENCY
+    unsigned long p50 = 0, p99 = 0, p100 = 0;
+    assert_int_equal(mem_pool_latency(pool, POOL_OP_ALLOC, 50.0, &p50), ALLOC_OK);
+    assert_int_equal(mem_pool_latency(pool, POOL_OP_ALLOC, 99.0, &p99), ALLOC_OK);
+    assert_int_equal(mem_pool_latency(pool, POOL_OP_ALLOC, 100.0, &p100), ALLOC_OK);
+    assert_true(p50 <= p99 && p99 <= p100);
+    assert_int_equal(mem_pool_latency(pool, POOL_OP_FREE, 99.9, &nanos), ALLOC_OK);
+    assert_int_equal(mem_pool_latency(pool, POOL_OP_OPEN, 50.0, &nanos), ALLOC_OK);
+    assert_int_equal(mem_pool_latency(pool, POOL_OP_CLOSE, 50.0, &nanos), ALLOC_FAIL);
+    assert_int_equal(mem_pool_dump_latency(pool, stdout), ALLOC_OK);
+#else
+    INFO("Latency histograms are compiled out\n");
+    assert_int_equal(mem_pool_latency(pool, POOL_OP_ALLOC, 50.0, &nanos), ALLOC_FAIL);
+    assert_int_equal(mem_pool_dump_latency(pool, stdout), ALLOC_FAIL);
+#endif
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+#ifdef MEM_POOL_LATENCY
+    // the process keeps the closed pool's samples, and counts the close
+    assert_int_equal(mem_pool_latency(NULL, POOL_OP_ALLOC, 50.0, &nanos), ALLOC_OK);
+    assert_int_equal(mem_pool_latency(NULL, POOL_OP_CLOSE, 50.0, &nanos), ALLOC_OK);
+
+    INFO("Timing the other ways to open a pool\n");
+    const size_t half = sizeof(caller_buffer) / 2;
+    pool_pt pools[3] = { mem_pool_open_reserved(POOL_SIZE, 4 * POOL_SIZE, FIRST_FIT),
+                         mem_pool_open_in(caller_buffer, half, FIRST_FIT),
+                         mem_pool_open_embedded(caller_buffer + half, half, FIRST_FIT) };
+    for(unsigned i = 0; i < 3; ++i) {
+        assert_non_null(pools[i]);
+        assert_int_equal(mem_pool_latency(pools[i], POOL_OP_OPEN, 50.0, &nanos), ALLOC_OK);
+        assert_int_equal(mem_pool_close(pools[i]), ALLOC_OK);
+    }
+#endif
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_profile(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+#ifdef MEM_POOL_PROFILE
+    INFO("Sampling every allocation\n");
+    unsigned long count = 0, bytes = 0;
+    char line[256];
+    assert_int_equal(mem_pool_set_profile_rate(1), ALLOC_OK);
+    void *allocs[4];
+    for(unsigned i = 0; i < 3; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    allocs[3] = mem_new_alloc(pool, 200);
+    assert_non_null(allocs[3]);
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+
+    INFO("Dumping the live samples\n");
+    FILE *out = tmpfile();
+    assert_non_null(out);
+    assert_int_equal(mem_pool_dump_profile(pool, out), ALLOC_OK);
+    rewind(out);
+    assert_int_equal(fscanf(out, "heap profile: %lu: %lu", &count, &bytes), 2);
+    assert_int_equal(count, 3);
+    assert_int_equal(bytes, 400);
+    // one line for the loop's call site, one for the other
+    unsigned sites = 0;
+    assert_non_null(fgets(line, sizeof(line), out)); // rest of the header
+    while(fgets(line, sizeof(line), out) && strncmp(line, "MAPPED_LIBRARIES", 16) != 0) {
+        if(strchr(line, '@')) sites ++;
+    }
+    assert_int_equal(sites, 2);
+    fclose(out);
+
+    INFO("Dropping the samples of a reset pool\n");
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    out = tmpfile();
+    assert_non_null(out);
+    assert_int_equal(mem_pool_dump_profile(pool, out), ALLOC_OK);
+    rewind(out);
+    assert_int_equal(fscanf(out, "heap profile: %lu: %lu", &count, &bytes), 2);
+    assert_int_equal(count, 0);
+    fclose(out);
+
+    INFO("Dropping the sample of an arena allocation freed by size\n");
+    pool_pt arena = mem_pool_open(POOL_SIZE, ARENA);
+    assert_non_null(arena);
+    void *alloc = mem_new_alloc(arena, 4096);
+    assert_non_null(alloc);
+    assert_int_equal(mem_del_alloc_sized(arena, alloc, 4096), ALLOC_OK);
+    out = tmpfile();
+    assert_non_null(out);
+    assert_int_equal(mem_pool_dump_profile(arena, out), ALLOC_OK);
+    rewind(out);
+    assert_int_equal(fscanf(out, "heap profile: %lu: %lu", &count, &bytes), 2);
+    assert_int_equal(count, 0);
+    assert_int_equal(bytes, 0);
+    fclose(out);
+    assert_int_equal(mem_pool_close(arena), ALLOC_OK);
+#else
+    INFO("Profiling is compiled out\n");
+    assert_int_equal(mem_pool_set_profile_rate(1), ALLOC_FAIL);
+    assert_int_equal(mem_pool_dump_profile(pool, stdout), ALLOC_FAIL);
+#endif
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_report(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+    char buffer[8192];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    void *alloc = mem_new_alloc(pool, 1000);
+    assert_non_null(alloc);
+
+    INFO("Writing a report in Prometheus text format\n");
+    FILE *out = tmpfile();
+    assert_non_null(out);
+    assert_int_equal(mem_report_write(fileno(out), REPORT_PROMETHEUS), ALLOC_OK);
+    rewind(out);
+    size_t size = fread(buffer, 1, sizeof(buffer) - 1, out);
+    buffer[size] = '\0';
+    fclose(out);
+    assert_non_null(strstr(buffer, "# TYPE mem_pool_alloc_size_bytes gauge\n"));
+    assert_non_null(strstr(buffer, "policy=\"BEST_FIT\"} 1000\n"));
+
+    INFO("Writing a report in JSON\n");
+    out = tmpfile();
+    assert_non_null(out);
+    assert_int_equal(mem_report_write(fileno(out), REPORT_JSON), ALLOC_OK);
+    rewind(out);
+    size = fread(buffer, 1, sizeof(buffer) - 1, out);
+    buffer[size] = '\0';
+    fclose(out);
+    assert_true(strncmp(buffer, "{\"pools\":[", 10) == 0);
+    assert_non_null(strstr(buffer, "\"policy\":\"BEST_FIT\",\"total_size\":"));
+    assert_non_null(strstr(buffer, "\"alloc_size\":1000,\"num_allocs\":1,"));
+
+    INFO("Reporting to a file from the reporter thread\n");
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mem_pool_report_%d.prom", (int) getpid());
+    assert_int_equal(mem_report_start_file(path, REPORT_PROMETHEUS, 10), ALLOC_OK);
+    assert_int_equal(mem_report_start_file(path, REPORT_PROMETHEUS, 10), ALLOC_CALLED_AGAIN);
+    usleep(50000);
+    assert_int_equal(mem_report_stop(), ALLOC_OK);
+    assert_int_equal(mem_report_stop(), ALLOC_FAIL);
+    out = fopen(path, "r");
+    assert_non_null(out);
+    size = fread(buffer, 1, sizeof(buffer) - 1, out);
+    buffer[size] = '\0';
+    fclose(out);
+    unlink(path);
+    assert_non_null(strstr(buffer, "policy=\"BEST_FIT\"} 1000\n"));
+
+    INFO("Stopping the reporter while a socket listener isn't reading\n");
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_true(listener >= 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "/tmp/mem_pool_report_%d.sock", (int) getpid());
+    assert_int_equal(bind(listener, (struct sockaddr *) &address, sizeof(address)), 0);
+    assert_int_equal(listen(listener, 4), 0);
+    assert_int_equal(mem_report_start_socket(address.sun_path, REPORT_PROMETHEUS, 1), ALLOC_OK);
+    // enough reports to fill the socket buffer, so that a send blocks
+    usleep(500000);
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert_int_equal(mem_report_stop(), ALLOC_OK);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    assert_true(stop.tv_sec - start.tv_sec < 3);
+    close(listener);
+    unlink(address.sun_path);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+typedef struct _snapshot_reader {
+    pool_pt pool;
+    size_t alloc_size; // of every allocation
+    atomic_int done;
+    atomic_ulong snapshots;
+    unsigned long torn; // snapshots that break an invariant of the pool
+} snapshot_reader_t;
+
+static void *read_snapshots(void *arg) {
+    snapshot_reader_t *reader = (snapshot_reader_t *) arg;
+    pool_stats_t stats;
+
+    // every allocation is the same size, and every free byte is in a gap
+    while(!atomic_load(&reader->done)) {
+        mem_pool_snapshot(reader->pool, &stats);
+        unsigned gaps = 0;
+        for(unsigned i = 0; i < MEM_POOL_HISTOGRAM_BUCKETS; ++i) gaps += stats.gap_histogram[i];
+        if(stats.alloc_size != stats.num_allocs * reader->alloc_size
+           || stats.alloc_size + stats.gap_size != stats.total_size
+           || gaps != stats.num_gaps) reader->torn ++;
+        atomic_fetch_add(&reader->snapshots, 1);
+    }
+
+    return NULL;
+}
+
+static void test_pool_snapshot(void **state) {
+    (void) state; /* unused */
+
+    enum { NUM_ALLOCS = 64, ALLOC_SIZE = 48 };
+    void *allocs[NUM_ALLOCS];
+    pool_pt pool = NULL;
+    pool_stats_t stats;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes\n", (unsigned long) (NUM_ALLOCS * ALLOC_SIZE));
+    pool = mem_pool_open(NUM_ALLOCS * ALLOC_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    INFO("Comparing a snapshot with the owner's stats\n");
+    allocs[0] = mem_new_alloc(pool, ALLOC_SIZE);
+    assert_non_null(allocs[0]);
+    assert_int_equal(mem_pool_snapshot(pool, &stats), ALLOC_OK);
+    pool_stats_t expected = mem_pool_stats(pool);
+    assert_int_equal(stats.alloc_size, expected.alloc_size);
+    assert_int_equal(stats.num_allocs, expected.num_allocs);
+    assert_int_equal(stats.gap_size, expected.gap_size);
+    assert_int_equal(stats.largest_gap, expected.largest_gap);
+    assert_int_equal(stats.num_gaps, expected.num_gaps);
+    assert_memory_equal(stats.gap_histogram, expected.gap_histogram, sizeof(stats.gap_histogram));
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+
+    INFO("Taking snapshots from another thread while allocating and freeing\n");
+    snapshot_reader_t reader = { .pool = pool, .alloc_size = ALLOC_SIZE, .torn = 0 };
+    atomic_init(&reader.done, 0);
+    atomic_init(&reader.snapshots, 0);
+    pthread_t thread;
+    assert_int_equal(pthread_create(&thread, NULL, read_snapshots, &reader), 0);
+    for(unsigned round = 0; round < 200 || atomic_load(&reader.snapshots) == 0; ++round) {
+        for(unsigned i = 0; i < NUM_ALLOCS; ++i) {
+            allocs[i] = mem_new_alloc(pool, ALLOC_SIZE);
+            assert_non_null(allocs[i]);
+        }
+        // free every other one first, so the gaps split and coalesce
+        for(unsigned i = 0; i < NUM_ALLOCS; i += 2) {
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+        }
+        for(unsigned i = 1; i < NUM_ALLOCS; i += 2) {
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+        }
+    }
+    atomic_store(&reader.done, 1);
+    assert_int_equal(pthread_join(thread, NULL), 0);
+    INFO("%lu snapshots, %lu torn\n", atomic_load(&reader.snapshots), reader.torn);
+    assert_int_equal(reader.torn, 0);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_layout(void **state) {
+    (void) state; /* unused */
+
+    pool_pt pool = NULL;
+    char buffer[4096];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Allocating pool of 1024 bytes, with a gap in the second quarter\n");
+    pool = mem_pool_open(1024, FIRST_FIT);
+    assert_non_null(pool);
+    void *alloc0 = mem_new_alloc(pool, 256);
+    void *alloc1 = mem_new_alloc(pool, 256);
+    void *alloc2 = mem_new_alloc(pool, 512);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_non_null(alloc2);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+
+    INFO("Rendering a PPM image, a pixel per quarter\n");
+    FILE *out = tmpfile();
+    assert_non_null(out);
+    assert_int_equal(mem_pool_render(pool, out, LAYOUT_PPM, 4, 1), ALLOC_OK);
+    rewind(out);
+    size_t size = fread(buffer, 1, sizeof(buffer), out);
+    fclose(out);
+    const char *header = "P6\n4 1\n255\n";
+    assert_int_equal(size, strlen(header) + 4 * 3);
+    assert_memory_equal(buffer, header, strlen(header));
+    const char *pixels = buffer + strlen(header);
+    assert_memory_not_equal(pixels, pixels + 3, 3); // allocation, gap
+    assert_memory_not_equal(pixels, pixels + 6, 3); // different size classes
+    assert_memory_equal(pixels + 6, pixels + 9, 3); // the same allocation
+
+    INFO("Rendering an ANSI map, with a partly allocated cell\n");
+    alloc1 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc1);
+    out = tmpfile();
+    assert_non_null(out);
+    assert_int_equal(mem_pool_render(pool, out, LAYOUT_ANSI, 4, 1), ALLOC_OK);
+    rewind(out);
+    assert_non_null(fgets(buffer, sizeof(buffer), out)); // the summary
+    assert_non_null(strstr(buffer, "1024 bytes, 3 allocations, 1 gaps, 256 bytes per cell"));
+    assert_non_null(fgets(buffer, sizeof(buffer), out)); // the row
+    fclose(out);
+    char glyphs[8];
+    unsigned num_glyphs = 0;
+    for(char *c = buffer; *c && *c != '\n' && num_glyphs < sizeof(glyphs); ++c) {
+        if(*c == '\x1b') c = strchr(c, 'm'); // skip the colors
+        else glyphs[num_glyphs ++] = *c;
+    }
+    assert_int_equal(num_glyphs, 4);
+    assert_memory_equal(glyphs, "#+##", 4);
+
+    INFO("Recording a time-lapse, a frame every 2 operations\n");
+    out = tmpfile();
+    assert_non_null(out);
+#ifdef MEM_POOL_LAYOUT
+    assert_int_equal(mem_pool_record_layout(pool, out, LAYOUT_PPM, 4, 1, 2), ALLOC_OK);
+    for(unsigned i = 0; i < 2; ++i) {
+        assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+        alloc1 = mem_new_alloc(pool, 100);
+        assert_non_null(alloc1);
+    }
+    assert_int_equal(mem_pool_record_layout(pool, NULL, LAYOUT_PPM, 0, 0, 0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    rewind(out);
+    size = fread(buffer, 1, sizeof(buffer) - 1, out);
+    buffer[size] = '\0';
+    const char *frame0 = "P6\n# frame 0, after 2 operations\n4 1\n255\n";
+    const char *frame1 = "P6\n# frame 1, after 4 operations\n4 1\n255\n";
+    assert_int_equal(size, strlen(frame0) + strlen(frame1) + 2 * 4 * 3);
+    assert_memory_equal(buffer, frame0, strlen(frame0));
+    assert_memory_equal(buffer + strlen(frame0) + 4 * 3, frame1, strlen(frame1));
+#else
+    assert_int_equal(mem_pool_record_layout(pool, out, LAYOUT_PPM, 4, 1, 2), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+#endif
+    fclose(out);
+
+    INFO("Closing pool\n");
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***         7. DRIVER ROUTINE           ***/
 /*******************************************/
 
 int run_test_suite() {
@@ -2433,6 +3861,31 @@ int run_test_suite() {
 
             // Stress tests
             cmocka_unit_test(test_pool_stresstest0),
+
+            // Pool variants
+            cmocka_unit_test(test_pool_reserved_growth),
+            cmocka_unit_test(test_pool_expandable_extents),
+            cmocka_unit_test(test_pool_purge),
+            cmocka_unit_test(test_pool_trim_and_shrink),
+            cmocka_unit_test(test_pool_caller_memory),
+            cmocka_unit_test(test_pool_many_small),
+            cmocka_unit_test(test_pool_arena),
+            cmocka_unit_test(test_pool_arena_marks),
+            cmocka_unit_test(test_pool_sized_free),
+            cmocka_unit_test(test_pool_tagged),
+            cmocka_unit_test(test_pool_bitmap),
+            cmocka_unit_test(test_pool_largest_gap),
+            cmocka_unit_test(test_pool_deferred),
+            cmocka_unit_test(test_pool_free_burst),
+            cmocka_unit_test(test_pool_quick_lists),
+            cmocka_unit_test(test_pool_walk),
+            cmocka_unit_test(test_pool_stats),
+            cmocka_unit_test(test_pool_counters),
+            cmocka_unit_test(test_pool_latency),
+            cmocka_unit_test(test_pool_profile),
+            cmocka_unit_test(test_pool_report),
+            cmocka_unit_test(test_pool_snapshot),
+            cmocka_unit_test(test_pool_layout),
     };
 
     return cmocka_run_group_tests_name("pool_test_suite", tests, NULL, NULL);